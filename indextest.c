@@ -0,0 +1,172 @@
+/*
+ * compare the results of vofind through its trigram index, and through
+ * the index of a daemon's pool, with a full scan, run with 'make check'
+ */
+#define main vofind_main
+#include "vofind.c"
+#undef main
+
+#include <ftw.h>
+#include <sys/wait.h>
+
+static const char *const names[] = {
+	"Smith", "smithson", "SMITH", "Jos\xc3\xa9", "J\xc3\xb6rg", "Anna-Lena",
+	"O'Brien", "van Dijck", "\xe2\x82\xac uro", "Zo", "ab", "abc",
+};
+#define NNAMES	(sizeof(names)/sizeof(names[0]))
+
+static const char *const domains[] = {
+	"example.com", "EXAMPLE.org", "m\xc3\xbcller.de", "x.io",
+};
+
+static const char *const tels[] = {
+	"+32 (0)4 12-34-56", "0412 345 678", "+1-555-0100", "112", "4123",
+};
+
+static int nfail, ntest;
+
+static int rmentry(const char *path, const struct stat *st, int flag,
+		struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void mkcorpus(FILE *fp, int nvcards)
+{
+	int j, k;
+
+	for (j = 0; j < nvcards; ++j) {
+		fprintf(fp, "BEGIN:VCARD\r\nVERSION:3.0\r\n");
+		if (j % 13)
+			fprintf(fp, "FN:%s %s %d\r\n", names[random() % NNAMES],
+					names[random() % NNAMES], j);
+		for (k = random() % 4; k; --k)
+			fprintf(fp, "EMAIL;TYPE=\"internet,home\":%s%d@%s\r\n",
+					names[random() % NNAMES], k,
+					domains[random() % 4]);
+		for (k = random() % 3; k; --k)
+			fprintf(fp, "TEL;TYPE=cell:%s%d\r\n",
+					tels[random() % 5], j % 10);
+		fprintf(fp, "END:VCARD\r\n");
+	}
+}
+
+/* run 1 query, in a child, how @mode asks, returns its output */
+static char *query(const char *mode, const char *file, const char *prop,
+		const char *needle, size_t *plen)
+{
+	char *argv[] = { "vofind", "-p", (char *)prop, (char *)needle,
+		(char *)file, NULL, NULL, };
+	char *out = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int fds[2], ret, status;
+	char buf[4096];
+	pid_t pid;
+
+	if (!strcmp(mode, "scan")) {
+		/* -n, before the needle */
+		memmove(argv+2, argv+1, 4*sizeof(*argv));
+		argv[1] = "-n";
+	}
+	if (pipe(fds) < 0)
+		elog(1, errno, "pipe");
+	pid = fork();
+	if (pid < 0)
+		elog(1, errno, "fork");
+	if (!pid) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		if (!strcmp(mode, "pool"))
+			pool_add(file);
+		exit(vofind(5 + !strcmp(mode, "scan"), argv));
+	}
+	close(fds[1]);
+	fp = open_memstream(&out, &len);
+	while ((ret = read(fds[0], buf, sizeof(buf))) > 0)
+		fwrite(buf, ret, 1, fp);
+	fclose(fp);
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status))
+		elog(0, 0, "%s -p %s '%s' failed", mode, prop, needle);
+	*plen = len;
+	return out;
+}
+
+static void check(const char *file, const char *prop, const char *needle)
+{
+	static const char *const modes[] = { "index", "pool", };
+	char *want, *got;
+	size_t wantlen, gotlen;
+	int j;
+
+	want = query("scan", file, prop, needle, &wantlen);
+	for (j = 0; j < 2; ++j) {
+		++ntest;
+		got = query(modes[j], file, prop, needle, &gotlen);
+		if (gotlen != wantlen || memcmp(got, want, wantlen)) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s -p %s '%s': %zu bytes, "
+						"want %zu\n", modes[j], prop,
+						needle, gotlen, wantlen);
+		}
+		free(got);
+	}
+	free(want);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const props[] = { "EMAIL", "TEL", };
+	static const char *const needles[] = {
+		"smith", "SMITH", "mIth", "sMithson", "Jos\xc3\xa9", "J\xc3\xb6",
+		"\xc3\xb6rg", "O'B", "van D", "uro", "abc", "ab", "zo1",
+		"example", "EXAMPLE.ORG", "@x.io", "m\xc3\xbcller", "ller.d",
+		"+32", "0412", "(0)4", "555", "12", "3456", "1123", "nobody",
+	};
+	char dir[] = "/tmp/indextestXXXXXX", file[64], *buf;
+	char needle[16];
+	size_t len;
+	FILE *fp;
+	int j, k, off;
+
+	/* the index lives in the cache directory */
+	if (!mkdtemp(dir))
+		elog(1, errno, "mkdtemp");
+	setenv("XDG_CACHE_HOME", dir, 1);
+	sprintf(file, "%s/cards.vcf", dir);
+	fp = fopen(file, "w");
+	if (!fp)
+		elog(1, errno, "fopen %s", file);
+	mkcorpus(fp, 2000);
+	fclose(fp);
+	vcard_build_index(file);
+
+	for (j = 0; j < sizeof(needles)/sizeof(needles[0]); ++j)
+		for (k = 0; k < 2; ++k)
+			check(file, props[k], needles[j]);
+
+	/* random needles from the file */
+	fp = fopen(file, "r");
+	buf = NULL;
+	len = 0;
+	if (!fp || getdelim(&buf, &len, 0, fp) < 0)
+		elog(1, errno, "read %s", file);
+	fclose(fp);
+	len = strlen(buf);
+	for (j = 0; j < 100; ++j) {
+		off = random() % (len - 8);
+		k = 1 + random() % 6;
+		memcpy(needle, buf + off, k);
+		needle[k] = 0;
+		if (strpbrk(needle, "\r\n"))
+			continue;
+		check(file, props[j % 2], needle);
+	}
+	free(buf);
+
+	nftw(dir, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+	printf("%s: %d queries, %d failures\n", argv[0], ntest, nfail);
+	return nfail ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * compare the parallel parser with the serial parser, on a VCALENDAR
+ * that is big enough to be split into its children, run with 'make check'
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+struct out {
+	char *buf;
+	size_t len, size;
+	int nvobjects;
+};
+
+static void append(struct out *o, const char *dat, size_t len)
+{
+	if (o->len + len > o->size) {
+		o->size = (o->len + len) * 2;
+		o->buf = realloc(o->buf, o->size);
+		if (!o->buf)
+			elog(LOG_ERR, errno, "realloc %zu", o->size);
+	}
+	memcpy(o->buf + o->len, dat, len);
+	o->len += len;
+}
+
+static void collect(struct vobject *vo, void *dat)
+{
+	struct out *o = dat;
+	size_t len;
+	char *buf;
+
+	len = vobject_serialized_size(vo, 0);
+	buf = malloc(len);
+	if (!buf)
+		elog(LOG_ERR, errno, "malloc %zu", len);
+	vobject_write_mem(vo, buf, len, 0);
+	append(o, buf, len);
+	free(buf);
+	vobject_free(vo);
+	++o->nvobjects;
+}
+
+static void printfs(struct out *o, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	append(o, buf, len);
+}
+
+/* a property that is folded, quoted or not ascii, depending on @j */
+static void mkprop(struct out *o, const char *key, int j)
+{
+	switch (j % 5) {
+	case 0:
+		printfs(o, "%s:value %d\r\n", key, j);
+		break;
+	case 1:
+		printfs(o, "%s;X-A=\"a;b:c\":folded %d\r\n  over\r\n\tlines\r\n",
+				key, j);
+		break;
+	case 2:
+		printfs(o, "%s;LANGUAGE=nl:h\xc3\xa9 \xe2\x82\xac%d "
+				"\xf0\x9f\x98\x80\r\n", key, j);
+		break;
+	case 3:
+		printfs(o, "%s:escaped\\, \\; \\n %d\n", key, j);
+		break;
+	default:
+		printfs(o, "%s:long %d ", key, j);
+		for (int k = 0; k < 60; ++k)
+			printfs(o, "w\xc3\xb6rd%d ", k);
+		printfs(o, "\r\n");
+		break;
+	}
+}
+
+static void mkvcard(struct out *o, int j)
+{
+	printfs(o, "BEGIN:VCARD\r\nVERSION:3.0\r\n");
+	mkprop(o, "FN", j);
+	printfs(o, "UID:card-%d\r\nEND:VCARD\r\n", j);
+}
+
+static void mkcalendar(struct out *o, int nevents)
+{
+	int j;
+
+	printfs(o, "BEGIN:VCALENDAR\r\nVERSION:2.0\r\n");
+	mkprop(o, "PRODID", 1);
+	for (j = 0; j < nevents; ++j) {
+		printfs(o, "BEGIN:VEVENT\r\nUID:event-%d\r\n", j);
+		mkprop(o, "SUMMARY", j);
+		mkprop(o, "DESCRIPTION", j+1);
+		if (j % 7 == 3) {
+			printfs(o, "BEGIN:VALARM\r\n");
+			mkprop(o, "DESCRIPTION", j+2);
+			printfs(o, "END:VALARM\r\n");
+		}
+		printfs(o, "END:VEVENT\r\n");
+		/* root properties between the children */
+		if (j % 3 == 0)
+			mkprop(o, "X-ROOT", j);
+		if (j == 5)
+			/* a continuation of the END line */
+			printfs(o, " dangling %d\r\n", j);
+	}
+	/* a folded root property, right before the END */
+	mkprop(o, "X-LAST", 1);
+	printfs(o, "END:VCALENDAR\r\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const int nthreads[] = { 1, 2, 4, 7, };
+	struct out input = {}, serial = {}, parallel;
+	char *buf, *dat;
+	struct vobject *vo;
+	int j, k, linenr, nfail = 0, ntest = 0;
+
+	for (k = 0; k < 3; ++k) {
+		input.len = 0;
+		for (j = 0; j < 20; ++j)
+			mkvcard(&input, j);
+		mkcalendar(&input, 3000 + 5000*k);
+		for (j = 0; j < 20; ++j)
+			mkvcard(&input, j);
+		if (k == 2) {
+			/* 2 big calendars in a row, the last one incomplete */
+			mkcalendar(&input, 7000);
+			input.len -= 200;
+		}
+
+		/* the serial reference, each parse consumes its copy */
+		buf = malloc(input.len);
+		memcpy(buf, input.buf, input.len);
+		serial.len = serial.nvobjects = linenr = 0;
+		for (dat = buf; (vo = vobject_next_mem(&dat, buf + input.len,
+						&linenr)); )
+			collect(vo, &serial);
+		free(buf);
+
+		for (j = 0; j < sizeof(nthreads)/sizeof(nthreads[0]); ++j) {
+			++ntest;
+			buf = malloc(input.len);
+			memcpy(buf, input.buf, input.len);
+			memset(&parallel, 0, sizeof(parallel));
+			vobject_parse_parallel(buf, buf + input.len, -1,
+					nthreads[j], NULL, collect, &parallel);
+			free(buf);
+			if (parallel.nvobjects != serial.nvobjects ||
+					parallel.len != serial.len ||
+					memcmp(parallel.buf, serial.buf, serial.len)) {
+				++nfail;
+				fprintf(stderr, "%zu bytes, %d threads: %d vobjects, "
+						"%zu bytes, want %d, %zu\n",
+						input.len, nthreads[j],
+						parallel.nvobjects, parallel.len,
+						serial.nvobjects, serial.len);
+			}
+			free(parallel.buf);
+		}
+	}
+	free(input.buf);
+	free(serial.buf);
+	printf("%s: %d parses, %d failures\n", argv[0], ntest, nfail);
+	return nfail ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * compare the push parser, fed in every possible way, with the
+ * parser of a memory buffer, run with 'make check'
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+static const char corpus[] =
+	"BEGIN:VCARD\r\n"
+	"VERSION:3.0\r\n"
+	"FN:Jos\xc3\xa9 Smith\r\n"
+	"N;LANGUAGE=\"nl;be:x\":Smith;Jos\xc3\xa9;;;\r\n"
+	"NOTE:a folded\r\n"
+	"  note\r\n"
+	"\tover 3 lines, \xe2\x82\xac\xf0\x9f\x98\x80\r\n"
+	"EMAIL;TYPE=\"internet,home\":jose@example.com\r\n"
+	"PHOTO;ENCODING=b;TYPE=JPEG:MIICajCCAdOgAwIBAgICBEUwDQYJKoZIhvcNAQEEBQAw\r\n"
+	" dzELMAkGA1UEBhMCVVMxLDAqBgNVBAoTI05ldHNjYXBlIENvbW11bmljYXRpb25zIENvcnBv\r\n"
+	" cmF0aW9uMRwwGgYDVQQLExNJbmZvcm1hdGlvbiBTeXN0ZW1zMRwwGgYDVQQDExNyb290Y2Eu\r\n"
+	"END:VCARD\r\n"
+	"BEGIN:VCALENDAR\n"
+	"VERSION:2.0\n"
+	"BEGIN:VEVENT\n"
+	"UID:1@example.com\n"
+	"SUMMARY:meeting\\, with \\;escapes\n"
+	"DESCRIPTION:only\n"
+	" LF\n"
+	"END:VEVENT\n"
+	"X-ROOT:between\n"
+	"BEGIN:VEVENT\n"
+	"UID:2@example.com\n"
+	"END:VEVENT\n"
+	"END:VCALENDAR\n"
+	"BEGIN:VCARD\r\n"
+	"FN:no final newline\r\n"
+	"END:VCARD";
+
+static int tmpfd = -1;
+static int nfail, ntest;
+
+static void append(char **pbuf, size_t *plen, const char *dat, size_t len)
+{
+	*pbuf = realloc(*pbuf, *plen + len);
+	if (!*pbuf)
+		elog(LOG_ERR, errno, "realloc");
+	memcpy(*pbuf + *plen, dat, len);
+	*plen += len;
+}
+
+static void dump(struct vobject *vo, char **pbuf, size_t *plen)
+{
+	size_t len;
+	char *str;
+
+	len = vobject_serialized_size(vo, 0);
+	str = malloc(len);
+	if (!str)
+		elog(LOG_ERR, errno, "malloc");
+	vobject_write_mem(vo, str, len, 0);
+	append(pbuf, plen, str, len);
+	free(str);
+	vobject_free(vo);
+}
+
+/*
+ * feed the corpus in chunks that end at @splits
+ * @lazy keeps values beyond that size out-of-line, in the temp file
+ */
+static void check(const int *splits, int nsplits, size_t lazy,
+		const char *want, size_t wantlen)
+{
+	struct vobject_parser *vp;
+	struct vobject *vo;
+	char *got = NULL;
+	size_t gotlen = 0;
+	int j, pos, end;
+
+	++ntest;
+	vp = vobject_parser_new();
+	if (lazy)
+		vobject_parser_lazy(vp, tmpfd, lazy);
+	for (j = pos = 0; j <= nsplits; ++j, pos = end) {
+		end = (j < nsplits) ? splits[j] : sizeof(corpus)-1;
+		if (end > pos)
+			vobject_parser_feed(vp, corpus + pos, end - pos);
+		while ((vo = vobject_parser_take(vp)) != NULL)
+			dump(vo, &got, &gotlen);
+	}
+	/* EOF */
+	vobject_parser_feed(vp, NULL, 0);
+	while ((vo = vobject_parser_take(vp)) != NULL)
+		dump(vo, &got, &gotlen);
+	vobject_parser_free(vp);
+
+	if (gotlen != wantlen || memcmp(got, want, wantlen)) {
+		if (++nfail < 10) {
+			fprintf(stderr, "lazy %zu, splits", lazy);
+			for (j = 0; j < nsplits; ++j)
+				fprintf(stderr, " %d", splits[j]);
+			fprintf(stderr, ": %zu bytes, want %zu\n", gotlen,
+					wantlen);
+		}
+	}
+	free(got);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t lazies[] = { 0, 16, };
+	int len = sizeof(corpus)-1, splits[len+1], j, k, l;
+	char buf[sizeof(corpus)], *dat, *want = NULL;
+	size_t wantlen = 0;
+	struct vobject *vo;
+	char path[] = "/tmp/pushtestXXXXXX";
+
+	/* lazy values are read back from the fed data */
+	tmpfd = mkstemp(path);
+	if (tmpfd < 0)
+		elog(LOG_ERR, errno, "mkstemp");
+	unlink(path);
+	if (write(tmpfd, corpus, len) != len)
+		elog(LOG_ERR, errno, "write");
+
+	/* the reference */
+	memcpy(buf, corpus, sizeof(corpus));
+	for (dat = buf; (vo = vobject_next_mem(&dat, buf+len, NULL)) != NULL; )
+		dump(vo, &want, &wantlen);
+
+	for (l = 0; l < sizeof(lazies)/sizeof(lazies[0]); ++l) {
+		/* in 1 piece */
+		check(NULL, 0, lazies[l], want, wantlen);
+		/* byte by byte */
+		for (j = 0; j < len; ++j)
+			splits[j] = j;
+		check(splits, len, lazies[l], want, wantlen);
+		/* each split in 2 pieces, and many in 3 */
+		for (j = 1; j < len; ++j) {
+			splits[0] = j;
+			check(splits, 1, lazies[l], want, wantlen);
+			for (k = j+1; k < len; k += 3) {
+				splits[1] = k;
+				check(splits, 2, lazies[l], want, wantlen);
+			}
+		}
+		/* random pieces */
+		for (j = 0; j < 2000; ++j) {
+			for (k = 0, splits[0] = random() % 16; splits[k] < len;
+					++k)
+				splits[k+1] = splits[k] + 1 + random() % 64;
+			check(splits, k, lazies[l], want, wantlen);
+		}
+	}
+	close(tmpfd);
+	free(want);
+	printf("%s: %d feeds, %d failures\n", argv[0], ntest, nfail);
+	return nfail ? 1 : 0;
+}
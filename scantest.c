@@ -0,0 +1,257 @@
+/*
+ * compare the delimiter scanners of the parser with the original
+ * byte by byte strchresc(), and the whole parser under each scanner,
+ * run with 'make check'
+ */
+#include "vobject.c"
+
+/* the parser's strchresc before the vector scanners */
+static char *strchresc_ref(const char *str, int c)
+{
+	int esc = 0;
+
+	for (; *str; ++str) {
+		if (esc) {
+			if (*str == esc)
+				esc = 0;
+		} else if (*str == c)
+			return (char *)str;
+		else if (strchr("\"'", *str))
+			esc = *str;
+	}
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	const char *(*fn)(const char *str, int c);
+} scanners[] = {
+	{ "scalar", scan_delim_scalar, },
+#ifdef __SSE2__
+	{ "sse2", scan_delim_sse2, },
+	{ "avx2", scan_delim_avx2, },
+#endif
+};
+#define NSCANNERS	(sizeof(scanners)/sizeof(scanners[0]))
+
+static int nfail, ntest;
+
+/* compare all scanners on @str */
+static void check(const char *str, int c)
+{
+	const char *want, *got;
+	int j;
+
+	++ntest;
+	for (j = 0; j < NSCANNERS; ++j) {
+#ifdef __SSE2__
+		if (scanners[j].fn == scan_delim_avx2 &&
+				!__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		/* the raw scan */
+		want = scan_delim_scalar(str, c);
+		got = scanners[j].fn(str, c);
+		if (got != want) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s: scan '%c' in '%s': %zd, want %zd\n",
+						scanners[j].name, c, str, got - str,
+						want - str);
+		}
+		/* the parser's use */
+		scan_delim = scanners[j].fn;
+		want = strchresc_ref(str, c);
+		got = strchresc(str, c);
+		if (got != want) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s: strchresc '%c' in '%s': %zd, want %zd\n",
+						scanners[j].name, c, str,
+						got ? got - str : -1, want ? want - str : -1);
+		}
+	}
+}
+
+/* a random property: quoted params, delimiters & multi-byte UTF-8 */
+static void mkprop(char **pbuf, size_t *plen, size_t *psize)
+{
+	/* the first 6 are safe outside quotes */
+	static const char *const pieces[] = {
+		"a", "bcd", "x-y", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+		";", ":", "=", ",", "'", "\\;", "\\,", "\\n", " ",
+	};
+	#define NPIECES	(sizeof(pieces)/sizeof(pieces[0]))
+	char line[2048], *str;
+	int j, n, len, fold, quoted;
+
+	len = sprintf(line, "X-%c", 'A' + (int)(random() % 26));
+	for (n = random() % 4; n; --n) {
+		/* params, quoted ones have delimiters inside */
+		len += sprintf(line+len, ";P%d=", n);
+		quoted = random() % 2;
+		if (quoted)
+			line[len++] = '"';
+		for (j = random() % 40; j; --j)
+			len += sprintf(line+len, "%s",
+					pieces[random() % (quoted ? NPIECES : 6)]);
+		/* rarely, the quote remains open */
+		if (quoted && random() % 8)
+			line[len++] = '"';
+	}
+	line[len++] = ':';
+	for (j = random() % 60; j; --j)
+		len += sprintf(line+len, "%s", pieces[random() % NPIECES]);
+	line[len] = 0;
+
+	/* fold at random places, also inside UTF-8 sequences */
+	for (str = line; *str; ) {
+		fold = 1 + random() % 90;
+		if (fold > strlen(str))
+			fold = strlen(str);
+		*pbuf = bufappend(*pbuf, plen, psize, str, fold);
+		str += fold;
+		*pbuf = bufappend(*pbuf, plen, psize, *str ? "\r\n " : "\r\n",
+				*str ? 3 : 2);
+	}
+}
+
+/* serialize @vo, with its split metadata, which uses the scanners */
+static void dump(struct vobject *vo, char **pbuf, size_t *plen, size_t *psize)
+{
+	const char *prop, *meta, *value;
+	char *str;
+	size_t len;
+
+	len = vobject_serialized_size(vo, 0);
+	str = malloc(len);
+	if (!str)
+		elog(LOG_ERR, errno, "malloc");
+	vobject_write_mem(vo, str, len, 0);
+	*pbuf = bufappend(*pbuf, plen, psize, str, len);
+	free(str);
+	for (prop = vobject_first_prop(vo); prop; prop = vprop_next(prop)) {
+		*pbuf = bufappend(*pbuf, plen, psize, prop, strlen(prop)+1);
+		for (meta = vprop_first_meta(prop); meta; meta = vprop_next(meta))
+			*pbuf = bufappend(*pbuf, plen, psize, meta,
+					strlen(meta)+1);
+		value = vprop_value(prop) ?: "";
+		*pbuf = bufappend(*pbuf, plen, psize, value, strlen(value)+1);
+	}
+}
+
+/* parse 1 corpus under each scanner */
+static void check_parser(int seed)
+{
+	char *corpus = NULL, *copy, *dat, *want = NULL, *got = NULL;
+	size_t len = 0, size = 0, wantlen = 0, wantsize = 0, gotlen, gotsize = 0;
+	struct vobject *vo;
+	int j, k;
+
+	srandom(seed);
+	for (j = 0; j < 50; ++j) {
+		corpus = bufappend(corpus, &len, &size,
+				"BEGIN:VCARD\r\nVERSION:3.0\r\n", 26);
+		for (k = random() % 20; k; --k)
+			mkprop(&corpus, &len, &size);
+		corpus = bufappend(corpus, &len, &size, "END:VCARD\r\n", 11);
+	}
+
+	copy = malloc(len);
+	if (!copy)
+		elog(LOG_ERR, errno, "malloc");
+	for (j = 0; j < NSCANNERS; ++j) {
+#ifdef __SSE2__
+		if (scanners[j].fn == scan_delim_avx2 &&
+				!__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		scan_delim = scanners[j].fn;
+		/* the parser works in-place */
+		memcpy(copy, corpus, len);
+		gotlen = 0;
+		for (dat = copy; (vo = vobject_next_mem(&dat, copy+len, NULL)); ) {
+			dump(vo, &got, &gotlen, &gotsize);
+			vobject_free(vo);
+		}
+		if (!j) {
+			/* the scalar scanner is the reference */
+			want = bufappend(want, &wantlen, &wantsize, got, gotlen);
+			continue;
+		}
+		if (gotlen != wantlen || memcmp(got, want, gotlen)) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s: parse corpus %d differs\n",
+						scanners[j].name, seed);
+		}
+	}
+	free(copy);
+	free(corpus);
+	free(want);
+	free(got);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char alphabet[] = "abc:;=\"'x";
+	static const char delims[] = ":;=";
+	char *page, *buf, *str;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int j, k, len, off, pos, d;
+
+	/* 2 pages, the second is not accessible */
+	page = mmap(NULL, pagesize*2, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		elog(LOG_ERR, errno, "mmap");
+	if (mprotect(page + pagesize, pagesize, PROT_NONE) < 0)
+		elog(LOG_ERR, errno, "mprotect");
+
+	/* 1 delimiter or quote at each position of 2 blocks, at each alignment */
+	buf = page;
+	for (off = 0; off < 32; ++off) {
+		for (len = 0; len < 72; ++len) {
+			for (pos = 0; pos <= len; ++pos) {
+				for (d = 0; d < 5; ++d) {
+					str = buf + off;
+					memset(str, 'a', len);
+					str[len] = 0;
+					if (pos < len)
+						str[pos] = ":;=\"'"[d];
+					for (k = 0; k < 3; ++k)
+						check(str, delims[k]);
+				}
+			}
+		}
+	}
+
+	/* strings that end just before the inaccessible page */
+	for (len = 0; len < 200; ++len) {
+		str = page + pagesize - len - 1;
+		for (k = 0; k < len; ++k)
+			str[k] = alphabet[random() % (sizeof(alphabet)-1)];
+		str[len] = 0;
+		for (k = 0; k < 3; ++k)
+			check(str, delims[k]);
+	}
+
+	/* random strings */
+	for (j = 0; j < 200000; ++j) {
+		off = random() % 64;
+		len = random() % (pagesize - off - 1);
+		if (j % 4)
+			len %= 128;
+		str = page + off;
+		for (k = 0; k < len; ++k)
+			str[k] = alphabet[random() % (sizeof(alphabet)-1)];
+		str[len] = 0;
+		check(str, delims[random() % 3]);
+	}
+
+	munmap(page, pagesize*2);
+
+	/* the whole parser */
+	for (j = 0; j < 200; ++j)
+		check_parser(j);
+	printf("%s: %d strings, %d corpora, %d failures\n", argv[0], ntest, j,
+			nfail);
+	return nfail ? 1 : 0;
+}
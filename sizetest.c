@@ -0,0 +1,164 @@
+/*
+ * check that vobject_serialized_size() predicts vobject_write_mem(),
+ * and that both match vobject_write2(), run with 'make check'
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+static const int flagsets[] = {
+	0,
+	VOF_NOBREAK,
+	VOF_UTF8,
+	VOF_CRNL,
+	VOF_UTF8 | VOF_CRNL,
+	VOF_WIDTH(16),
+	VOF_WIDTH(75) | VOF_UTF8,
+	VOF_WIDTH(75) | VOF_UTF8 | VOF_CRNL,
+	VOF_WIDTH(255) | VOF_CRNL,
+};
+#define NFLAGSETS	(sizeof(flagsets)/sizeof(flagsets[0]))
+
+static int nfail, ntest;
+
+/* a random value: long, multi-byte UTF-8, with escapes & newlines */
+static void mkvalue(char *str, int len)
+{
+	static const char *const pieces[] = {
+		"a", "bcd", " ", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+		"\\,", "\\;", "\\n",
+	};
+	int n = 0;
+
+	while (n < len - 5)
+		n += sprintf(str+n, "%s", pieces[random() %
+				(sizeof(pieces)/sizeof(pieces[0]))]);
+	str[n] = 0;
+}
+
+static void mkcorpus(FILE *fp, int nvobjects)
+{
+	char value[1024];
+	int j, k;
+
+	for (j = 0; j < nvobjects; ++j) {
+		fprintf(fp, "BEGIN:VCARD\r\nVERSION:3.0\r\n");
+		for (k = random() % 8; k; --k) {
+			mkvalue(value, random() % sizeof(value));
+			fprintf(fp, "NOTE;LANGUAGE=\"x;y:z\":%s\r\n", value);
+		}
+		if (j % 4 == 1) {
+			/* out-of-line with vobject_reader_lazy */
+			fprintf(fp, "PHOTO;ENCODING=b;TYPE=JPEG:");
+			for (k = 0; k < 40; ++k)
+				fprintf(fp, "%sMIICajCCAdOgAwIBAgICBEUwDQYJKoZIhvcNAQEE",
+						k ? "\r\n " : "");
+			fprintf(fp, "\r\n");
+		}
+		if (j % 3 == 0) {
+			/* a child, and a folded source text */
+			mkvalue(value, 300);
+			fprintf(fp, "BEGIN:X-CHILD\r\nX-A:%.70s\r\n %s\r\n"
+					"END:X-CHILD\r\n", value, value+70);
+		}
+		fprintf(fp, "END:VCARD\r\n");
+	}
+}
+
+static void check(const struct vobject *vo, const char *what)
+{
+	char *mem, *file = NULL;
+	size_t size, len, filelen;
+	FILE *fp;
+	int j;
+
+	for (j = 0; j < NFLAGSETS; ++j) {
+		++ntest;
+		size = vobject_serialized_size(vo, flagsets[j]);
+		/* 1 guard byte */
+		mem = malloc(size + 1);
+		if (!mem)
+			elog(LOG_ERR, errno, "malloc");
+		mem[size] = 0x5a;
+		len = vobject_write_mem(vo, mem, size, flagsets[j]);
+
+		fp = open_memstream(&file, &filelen);
+		if (!fp)
+			elog(LOG_ERR, errno, "open_memstream");
+		vobject_write2(vo, fp, flagsets[j]);
+		fclose(fp);
+
+		if (len != size || mem[size] != 0x5a || filelen != size ||
+				memcmp(mem, file, size)) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s, flags 0x%x: size %zu, "
+						"written %zu, vobject_write2 %zu\n",
+						what, flagsets[j], size, len,
+						filelen);
+		}
+
+		/* a short buffer gets the start only */
+		len = vobject_write_mem(vo, mem, size/2, flagsets[j]);
+		if (len != size || memcmp(mem, file, size/2)) {
+			if (++nfail < 10)
+				fprintf(stderr, "%s, flags 0x%x: short buffer\n",
+						what, flagsets[j]);
+		}
+		free(file);
+		file = NULL;
+		free(mem);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct vobject_reader *rd;
+	struct vobject *vo;
+	char path[] = "/tmp/sizetestXXXXXX", *dat, *pos;
+	size_t len;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		elog(LOG_ERR, errno, "mkstemp");
+	unlink(path);
+	fp = fdopen(dup(fd), "w");
+	if (!fp)
+		elog(LOG_ERR, errno, "fdopen");
+	mkcorpus(fp, 300);
+	fclose(fp);
+
+	/* parsed from memory, serialized */
+	dat = vobject_mmap(fd, &len);
+	if (!dat)
+		elog(LOG_ERR, errno, "mmap");
+	for (pos = dat; (vo = vobject_next_mem(&pos, dat+len, NULL)) != NULL; ) {
+		check(vo, "parsed");
+		vobject_free(vo);
+	}
+	vobject_munmap(dat, len);
+
+	/* with their source text, refolded */
+	lseek(fd, 0, SEEK_SET);
+	rd = vobject_reader_fd(fd, 0);
+	vobject_reader_raw(rd);
+	vobject_reader_lazy(rd, 64);
+	while ((vo = vobject_reader_next(rd)) != NULL) {
+		check(vo, "raw");
+		/* modified, serialized around its out-of-line values */
+		vobject_add_prop(vo, "X-ADDED", "a value, \xc3\xa9");
+		check(vo, "modified");
+		vobject_free(vo);
+	}
+	vobject_reader_free(rd);
+
+	printf("%s: %d writes, %d failures\n", argv[0], ntest, nfail);
+	return nfail ? 1 : 0;
+}
@@ -3,23 +3,18 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
-#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "vobject.h"
-
-/* generic error logging */
-#define elog(level, errnum, fmt, ...) \
-	{\
-		fprintf(stderr, "%s: " fmt "\n", "vobject", ##__VA_ARGS__);\
-		if (errnum)\
-			fprintf(stderr, "\t: %s\n", strerror(errnum));\
-		if (level >= LOG_ERR)\
-			exit(1);\
-		fflush(stderr);\
-	}
+#include "vopriv.h"
 
 /* helper functions */
 static void *zalloc(unsigned int size)
@@ -33,9 +28,153 @@ static void *zalloc(unsigned int size)
 	return ptr;
 }
 
+/*
+ * source file of out-of-line values
+ * It is shared by the reader and the arenas with out-of-line values.
+ */
+struct vsource {
+	int fd;
+	int refcnt;
+};
+
+static struct vsource *vsource_new(int fd)
+{
+	struct vsource *src;
+
+	src = zalloc(sizeof(*src));
+	src->fd = fd;
+	src->refcnt = 1;
+	return src;
+}
+
+static struct vsource *vsource_get(struct vsource *src)
+{
+	++src->refcnt;
+	return src;
+}
+
+static void vsource_put(struct vsource *src)
+{
+	if (--src->refcnt)
+		return;
+	close(src->fd);
+	free(src);
+}
+
+/*
+ * arena allocator
+ * A vobject tree allocates all its memory from its arena,
+ * and is freed at once when the last vobject that refers to it is freed.
+ */
+struct arena {
+	struct arenablk {
+		struct arenablk *next;
+		size_t size, fill;
+		char dat[];
+	} *blk;
+	int refcnt;
+	/* source of the out-of-line values */
+	struct vsource *src;
+};
+
+#define ARENA_BLKSZ	4096
+
+static struct arena *arena_new(void)
+{
+	struct arena *a;
+
+	a = zalloc(sizeof(*a));
+	a->refcnt = 1;
+	return a;
+}
+
+static struct arena *arena_get(struct arena *a)
+{
+	++a->refcnt;
+	return a;
+}
+
+static void arena_put(struct arena *a)
+{
+	struct arenablk *blk;
+
+	if (--a->refcnt)
+		return;
+	while (a->blk) {
+		blk = a->blk;
+		a->blk = blk->next;
+		free(blk);
+	}
+	if (a->src)
+		vsource_put(a->src);
+	free(a);
+}
+
+/* allocate uninitialized memory, @align must be a power of 2 */
+static void *arena_alloc2(struct arena *a, size_t size, size_t align)
+{
+	struct arenablk *blk = a->blk;
+	size_t pos, blksize;
+
+	pos = blk ? (blk->fill + align-1) & ~(align-1) : 0;
+	if (!blk || pos + size > blk->size) {
+		/* grow block sizes with the arena */
+		blksize = blk ? blk->size*2 : ARENA_BLKSZ - sizeof(*blk);
+		if (blksize > 64*ARENA_BLKSZ)
+			blksize = 64*ARENA_BLKSZ;
+		if (blksize < size)
+			blksize = size;
+		blk = malloc(sizeof(*blk) + blksize);
+		if (!blk)
+			elog(LOG_ERR, errno, "malloc %zu", sizeof(*blk) + blksize);
+		blk->size = blksize;
+		blk->next = a->blk;
+		a->blk = blk;
+		pos = 0;
+	}
+	blk->fill = pos + size;
+	return blk->dat + pos;
+}
+
+static void *arena_zalloc(struct arena *a, size_t size)
+{
+	void *ptr;
+
+	ptr = arena_alloc2(a, size, sizeof(void *));
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static char *arena_strndup(struct arena *a, const char *str, size_t len)
+{
+	char *dup;
+
+	dup = arena_alloc2(a, len+1, 1);
+	memcpy(dup, str, len);
+	dup[len] = 0;
+	return dup;
+}
+
+static inline char *arena_strdup(struct arena *a, const char *str)
+{
+	return arena_strndup(a, str, strlen(str));
+}
+
+/*
+ * out-of-line value: the lines of the property in the source file,
+ * the value starts @skip bytes into the unfolded text
+ */
+struct vlazy {
+	off_t off;
+	size_t len;
+	size_t skip;
+};
+
 /* vobject parser struct */
 struct vobject {
-	char *type; /* VCALENDAR, VCARD, VEVENT, ... */
+	const char *type; /* VCALENDAR, VCARD, VEVENT, ... */
+	enum vobject_kind kind;
+	struct arena *arena;
 	struct vprop {
 		/* IMPORTANT: sub & lastsub order must match parents 'props & proplast' */
 		struct vprop *next, *prev;
@@ -44,9 +183,23 @@ struct vobject {
 		struct vprop *sub, *lastsub;
 
 		char *value;
+		/* metadata, until it is parsed into sub */
+		char *rawmeta;
+		/* out-of-line value, until it is read */
+		struct vlazy *lazy;
+		int atom;
+		/* attached to a vobject, up is its fake parent */
+		char toplevel;
 		/* key may be used to iterate */
 		char key[8];
 	} *props, *proplast;
+	/* lookup index of many props, built on demand */
+	struct vpropidx *idx;
+	/* compact view of the props, built on demand */
+	struct vpropview *view;
+	/* source text of a toplevel vobject, valid until it is dirty */
+	struct vlazy raw;
+	int dirty;
 	/* hierarchy */
 	struct vobject *next, *prev;
 	struct vobject *list, *listlast, *parent;
@@ -54,6 +207,44 @@ struct vobject {
 	void *priv;
 };
 
+/*
+ * the first prop of each atom, with open addressing
+ * Any change to the props drops the index.
+ */
+struct vpropidx {
+	unsigned size;
+	struct vprop *vps[];
+};
+
+/*
+ * the props as contiguous arrays, indexed 0 .. n-1
+ * Values of out-of-line props are filled when read.
+ * The metadata arrays are built on first use.
+ */
+struct vpropview {
+	int n;
+	struct vprop **vps;
+	const char **values;
+	size_t *lens;
+	int *atoms;
+	/* the metadata of prop j are metafirst[j] .. metafirst[j+1]-1 */
+	const char **metavalues;
+	int *metafirst;
+	int *metaatoms;
+};
+
+/* build the index when a lookup walks more props */
+#define VPROPIDX_MIN	16
+
+/* the fake parent vprop of the props of a vobject */
+#define vobjecttovprop(vo) \
+	((struct vprop *)(((char *)&(vo)->props) - offsetof(struct vprop, sub)))
+
+/* the vobject of a (toplevel) vprop */
+#define vproptovobject(vp) \
+	((struct vobject *)(((char *)(vp)->up) + offsetof(struct vprop, sub) \
+			    - offsetof(struct vobject, props)))
+
 #define usertovprop(str) ((struct vprop *)((str)-offsetof(struct vprop, key)))
 #define vproptouser(vprop)	((vprop) ? (vprop)->key : NULL)
 
@@ -73,15 +264,26 @@ const char *vobject_type(const struct vobject *vc)
 	return vc->type;
 }
 
+enum vobject_kind vobject_kind(const struct vobject *vc)
+{
+	return vc->kind;
+}
+
 /* vprop walk function */
 const char *vobject_first_prop(const struct vobject *vc)
 {
 	return vproptouser(vc->props);
 }
 
+static void vprop_parse_meta(struct vprop *vp);
+static void vprop_read_lazy(struct vprop *vp);
+
 const char *vprop_first_meta(const char *str)
 {
-	return vproptouser(usertovprop(str)->sub);
+	struct vprop *vp = usertovprop(str);
+
+	vprop_parse_meta(vp);
+	return vproptouser(vp->sub);
 }
 
 const char *vprop_next(const char *key)
@@ -92,7 +294,11 @@ const char *vprop_next(const char *key)
 /* access vprop attributes */
 const char *vprop_value(const char *key)
 {
-	return usertovprop(key)->value;
+	struct vprop *vp = usertovprop(key);
+
+	if (vp->lazy)
+		vprop_read_lazy(vp);
+	return vp->value;
 }
 
 /* utility to export lower case string */
@@ -121,34 +327,433 @@ const char *lowercase(const char *str)
 	return locasestr;
 }
 
+/*
+ * atom table
+ * The well-known names are hashed once, and looked up without locking.
+ * Other names are added under a lock, and are never removed.
+ */
+static const char *const vatom_names[VA_NWELLKNOWN] = {
+	[VA_ADR] = "ADR",
+	[VA_BDAY] = "BDAY",
+	[VA_CATEGORIES] = "CATEGORIES",
+	[VA_EMAIL] = "EMAIL",
+	[VA_FN] = "FN",
+	[VA_KEY] = "KEY",
+	[VA_LABEL] = "LABEL",
+	[VA_LOGO] = "LOGO",
+	[VA_N] = "N",
+	[VA_NICKNAME] = "NICKNAME",
+	[VA_NOTE] = "NOTE",
+	[VA_ORG] = "ORG",
+	[VA_PHOTO] = "PHOTO",
+	[VA_PRODID] = "PRODID",
+	[VA_REV] = "REV",
+	[VA_ROLE] = "ROLE",
+	[VA_SOUND] = "SOUND",
+	[VA_TEL] = "TEL",
+	[VA_TITLE] = "TITLE",
+	[VA_UID] = "UID",
+	[VA_URL] = "URL",
+	[VA_VERSION] = "VERSION",
+	[VA_ATTACH] = "ATTACH",
+	[VA_ATTENDEE] = "ATTENDEE",
+	[VA_CALSCALE] = "CALSCALE",
+	[VA_CLASS] = "CLASS",
+	[VA_CREATED] = "CREATED",
+	[VA_DESCRIPTION] = "DESCRIPTION",
+	[VA_DTEND] = "DTEND",
+	[VA_DTSTAMP] = "DTSTAMP",
+	[VA_DTSTART] = "DTSTART",
+	[VA_DUE] = "DUE",
+	[VA_DURATION] = "DURATION",
+	[VA_EXDATE] = "EXDATE",
+	[VA_LAST_MODIFIED] = "LAST-MODIFIED",
+	[VA_LOCATION] = "LOCATION",
+	[VA_METHOD] = "METHOD",
+	[VA_ORGANIZER] = "ORGANIZER",
+	[VA_RDATE] = "RDATE",
+	[VA_RECURRENCE_ID] = "RECURRENCE-ID",
+	[VA_RRULE] = "RRULE",
+	[VA_SEQUENCE] = "SEQUENCE",
+	[VA_STATUS] = "STATUS",
+	[VA_SUMMARY] = "SUMMARY",
+	[VA_TRANSP] = "TRANSP",
+	[VA_TZID] = "TZID",
+	[VA_TZNAME] = "TZNAME",
+	[VA_TZOFFSETFROM] = "TZOFFSETFROM",
+	[VA_TZOFFSETTO] = "TZOFFSETTO",
+	[VA_ALTID] = "ALTID",
+	[VA_CHARSET] = "CHARSET",
+	[VA_CN] = "CN",
+	[VA_ENCODING] = "ENCODING",
+	[VA_LANGUAGE] = "LANGUAGE",
+	[VA_MEDIATYPE] = "MEDIATYPE",
+	[VA_PARTSTAT] = "PARTSTAT",
+	[VA_PREF] = "PREF",
+	[VA_RSVP] = "RSVP",
+	[VA_TYPE] = "TYPE",
+	[VA_VALUE] = "VALUE",
+};
+
+/* open addressing, 0 is free */
+#define VATOM_WKSIZE	256
+static unsigned char vatom_wkhash[VATOM_WKSIZE];
+
+static struct {
+	pthread_rwlock_t lock;
+	char **names;
+	int nnames, snames;
+	int *hash;
+	unsigned hashsize;
+} vatoms = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/* recent dynamic atoms of this thread, to avoid the lock */
+#define VATOM_CACHESIZE	64
+static __thread struct vatomcache {
+	const char *name;
+	int atom;
+} vatom_cache[VATOM_CACHESIZE];
+
+static unsigned vatom_hash(const char *name)
+{
+	unsigned hash = 2166136261u;
+
+	/* fold case, other collisions are resolved by strcasecmp */
+	for (; *name; ++name)
+		hash = (hash ^ (*name & ~0x20)) * 16777619;
+	return hash;
+}
+
+__attribute__((constructor))
+static void init_vatoms(void)
+{
+	unsigned j;
+	int atom;
+
+	for (atom = VA_UNKNOWN+1; atom < VA_NWELLKNOWN; ++atom) {
+		for (j = vatom_hash(vatom_names[atom]); vatom_wkhash[j % VATOM_WKSIZE]; ++j);
+		vatom_wkhash[j % VATOM_WKSIZE] = atom;
+	}
+}
+
+/* find a dynamic atom, with the lock held */
+static int vatom_find(const char *name, unsigned hash)
+{
+	unsigned j;
+	int atom;
+
+	if (!vatoms.hashsize)
+		return VA_UNKNOWN;
+	for (j = hash; (atom = vatoms.hash[j & (vatoms.hashsize-1)]); ++j)
+		if (!strcasecmp(vatoms.names[atom - VA_NWELLKNOWN], name))
+			return atom;
+	return VA_UNKNOWN;
+}
+
+/* add a dynamic atom, with the write lock held */
+static int vatom_add(const char *name)
+{
+	unsigned j, size;
+	int atom, other;
+
+	if (vatoms.nnames >= vatoms.snames) {
+		vatoms.snames = vatoms.snames*2 ?: 64;
+		vatoms.names = realloc(vatoms.names, vatoms.snames*sizeof(*vatoms.names));
+		if (!vatoms.names)
+			elog(LOG_ERR, errno, "realloc");
+	}
+	vatoms.names[vatoms.nnames] = strdup(name);
+	if (!vatoms.names[vatoms.nnames])
+		elog(LOG_ERR, errno, "strdup");
+	atom = VA_NWELLKNOWN + vatoms.nnames++;
+
+	if (vatoms.nnames*2 > vatoms.hashsize) {
+		/* rehash, keep the load below 50% */
+		size = vatoms.hashsize*2 ?: 128;
+		free(vatoms.hash);
+		vatoms.hash = zalloc(size*sizeof(*vatoms.hash));
+		vatoms.hashsize = size;
+		for (other = VA_NWELLKNOWN; other < atom; ++other) {
+			for (j = vatom_hash(vatoms.names[other - VA_NWELLKNOWN]);
+					vatoms.hash[j & (size-1)]; ++j);
+			vatoms.hash[j & (size-1)] = other;
+		}
+	}
+	for (j = vatom_hash(name); vatoms.hash[j & (vatoms.hashsize-1)]; ++j);
+	vatoms.hash[j & (vatoms.hashsize-1)] = atom;
+	return atom;
+}
+
+/* find the atom of @name, and create it when @create */
+static int vatom_lookup(const char *name, int create)
+{
+	unsigned hash = vatom_hash(name), j;
+	struct vatomcache *c;
+	int atom;
+
+	for (j = hash; (atom = vatom_wkhash[j % VATOM_WKSIZE]); ++j)
+		if (!strcasecmp(vatom_names[atom], name))
+			return atom;
+
+	c = &vatom_cache[hash % VATOM_CACHESIZE];
+	if (c->name && !strcasecmp(c->name, name))
+		return c->atom;
+
+	pthread_rwlock_rdlock(&vatoms.lock);
+	atom = vatom_find(name, hash);
+	if (!atom && create) {
+		pthread_rwlock_unlock(&vatoms.lock);
+		pthread_rwlock_wrlock(&vatoms.lock);
+		/* another thread may have added it */
+		atom = vatom_find(name, hash) ?: vatom_add(name);
+	}
+	if (atom) {
+		/* the names are never freed */
+		c->name = vatoms.names[atom - VA_NWELLKNOWN];
+		c->atom = atom;
+	}
+	pthread_rwlock_unlock(&vatoms.lock);
+	return atom;
+}
+
+int vobject_atom(const char *name)
+{
+	return vatom_lookup(name, 1);
+}
+
+const char *vobject_atom_name(int atom)
+{
+	const char *name = NULL;
+
+	if (atom > VA_UNKNOWN && atom < VA_NWELLKNOWN)
+		return vatom_names[atom];
+	pthread_rwlock_rdlock(&vatoms.lock);
+	if (atom >= VA_NWELLKNOWN && atom < VA_NWELLKNOWN + vatoms.nnames)
+		name = vatoms.names[atom - VA_NWELLKNOWN];
+	pthread_rwlock_unlock(&vatoms.lock);
+	return name;
+}
+
+int vprop_atom(const char *prop)
+{
+	return usertovprop(prop)->atom;
+}
+
+static inline unsigned vpropidx_hash(int atom)
+{
+	return atom * 2654435761u;
+}
+
+/* a vobject changed, its source text is outdated */
+static void vobject_set_dirty(struct vobject *vo)
+{
+	for (; vo; vo = vo->parent)
+		vo->dirty = 1;
+}
+
+/* drop the caches of the props */
+static void vobject_props_changed(struct vobject *vo)
+{
+	vobject_set_dirty(vo);
+	free(vo->idx);
+	vo->idx = NULL;
+	if (vo->view)
+		free(vo->view->metavalues);
+	free(vo->view);
+	vo->view = NULL;
+}
+
+static void vobject_build_index(struct vobject *vo)
+{
+	struct vprop *vp, *other;
+	unsigned size, j;
+	int n = 0;
+
+	for (vp = vo->props; vp; vp = vp->next)
+		++n;
+	for (size = 32; size < n*2; size *= 2);
+	vo->idx = zalloc(sizeof(*vo->idx) + size*sizeof(vo->idx->vps[0]));
+	vo->idx->size = size;
+	for (vp = vo->props; vp; vp = vp->next) {
+		for (j = vpropidx_hash(vp->atom);
+				(other = vo->idx->vps[j & (size-1)]); ++j)
+			if (other->atom == vp->atom)
+				break;
+		if (!other)
+			vo->idx->vps[j & (size-1)] = vp;
+	}
+}
+
 /* fast access functions */
-const char *vobject_prop(const struct vobject *vc, const char *propname)
+const char *vobject_prop_atom(const struct vobject *vc, int atom)
 {
+	/* the index is a cache */
+	struct vobject *vo = (struct vobject *)vc;
 	struct vprop *vp;
-
-	for (vp = vc->props; vp; vp = vp->next) {
-		if (!strcasecmp(vp->key, propname))
-			return vp->value;
+	unsigned j;
+	int n;
+
+	if (vo->idx) {
+		for (j = vpropidx_hash(atom);
+				(vp = vo->idx->vps[j & (vo->idx->size-1)]); ++j) {
+			if (vp->atom == atom)
+				return vprop_value(vp->key);
+		}
+		return NULL;
 	}
-	return NULL;
+	for (vp = vo->props, n = 0; vp; vp = vp->next, ++n) {
+		if (vp->atom == atom)
+			break;
+	}
+	if (n > VPROPIDX_MIN)
+		vobject_build_index(vo);
+	return vp ? vprop_value(vp->key) : NULL;
 }
 
-const char *vprop_meta(const char *prop, const char *metaname)
+const char *vobject_prop(const struct vobject *vc, const char *propname)
+{
+	int atom = vatom_lookup(propname, 0);
+
+	/* all keys are interned, so an unknown name is absent */
+	return atom ? vobject_prop_atom(vc, atom) : NULL;
+}
+
+const char *vprop_meta_atom(const char *prop, int atom)
 {
 	const char *key;
 
 	for (key = vprop_first_meta(prop); key; key = vprop_next(key)) {
-		if (!strcasecmp(key, metaname))
+		if (usertovprop(key)->atom == atom)
 			return vprop_value(key) ?: "";
 	}
 	return NULL;
 }
 
+const char *vprop_meta(const char *prop, const char *metaname)
+{
+	int atom = vatom_lookup(metaname, 0);
+
+	return atom ? vprop_meta_atom(prop, atom) : NULL;
+}
+
+/* compact view */
+static struct vpropview *vobject_view(const struct vobject *vc)
+{
+	/* the view is a cache */
+	struct vobject *vo = (struct vobject *)vc;
+	struct vpropview *v;
+	struct vprop *vp;
+	int n = 0;
+
+	if (vo->view)
+		return vo->view;
+	for (vp = vo->props; vp; vp = vp->next)
+		++n;
+	v = zalloc(sizeof(*v) + n*(sizeof(*v->vps) + sizeof(*v->values) +
+				sizeof(*v->lens) + sizeof(*v->atoms)));
+	v->n = n;
+	v->vps = (void *)(v+1);
+	v->values = (void *)(v->vps + n);
+	v->lens = (void *)(v->values + n);
+	v->atoms = (void *)(v->lens + n);
+	for (vp = vo->props, n = 0; vp; vp = vp->next, ++n) {
+		v->vps[n] = vp;
+		v->atoms[n] = vp->atom;
+		if (vp->value && !vp->lazy) {
+			v->values[n] = vp->value;
+			v->lens[n] = strlen(vp->value);
+		}
+	}
+	vo->view = v;
+	return v;
+}
+
+static void vpropview_build_meta(struct vpropview *v)
+{
+	struct vprop *meta;
+	int j, n = 0;
+
+	for (j = 0; j < v->n; ++j) {
+		vprop_parse_meta(v->vps[j]);
+		for (meta = v->vps[j]->sub; meta; meta = meta->next)
+			++n;
+	}
+	v->metavalues = zalloc(n*sizeof(*v->metavalues) +
+			(v->n+1+n)*sizeof(*v->metafirst));
+	v->metafirst = (void *)(v->metavalues + n);
+	v->metaatoms = v->metafirst + v->n+1;
+	for (j = n = 0; j < v->n; ++j) {
+		v->metafirst[j] = n;
+		for (meta = v->vps[j]->sub; meta; meta = meta->next, ++n) {
+			v->metaatoms[n] = meta->atom;
+			v->metavalues[n] = meta->value ?: "";
+		}
+	}
+	v->metafirst[j] = n;
+}
+
+int vobject_nprops(const struct vobject *vc)
+{
+	return vobject_view(vc)->n;
+}
+
+const char *vobject_prop_at(const struct vobject *vc, int idx)
+{
+	return vobject_view(vc)->vps[idx]->key;
+}
+
+int vobject_atom_at(const struct vobject *vc, int idx)
+{
+	return vobject_view(vc)->atoms[idx];
+}
+
+const char *vobject_value_at(const struct vobject *vc, int idx, size_t *plen)
+{
+	struct vpropview *v = vobject_view(vc);
+
+	if (!v->values[idx]) {
+		v->values[idx] = vprop_value(v->vps[idx]->key);
+		if (v->values[idx])
+			v->lens[idx] = strlen(v->values[idx]);
+	}
+	if (plen)
+		*plen = v->lens[idx];
+	return v->values[idx];
+}
+
+const char *vobject_meta_at(const struct vobject *vc, int idx, int atom)
+{
+	struct vpropview *v = vobject_view(vc);
+	int j;
+
+	if (!v->metafirst)
+		vpropview_build_meta(v);
+	for (j = v->metafirst[idx]; j < v->metafirst[idx+1]; ++j) {
+		if (v->metaatoms[j] == atom)
+			return v->metavalues[j];
+	}
+	return NULL;
+}
+
+int vobject_find_atom(const struct vobject *vc, int atom, int idx)
+{
+	struct vpropview *v = vobject_view(vc);
+
+	for (; idx < v->n; ++idx) {
+		if (v->atoms[idx] == atom)
+			return idx;
+	}
+	return -1;
+}
+
 /* vobject hierarchy */
 void vobject_detach(struct vobject *vo)
 {
 	if (!vo->parent)
 		return;
+	vobject_set_dirty(vo->parent);
 	if (vo->parent->list == vo)
 		vo->parent->list = vo->next;
 	if (vo->parent->listlast == vo)
@@ -171,6 +776,7 @@ void vobject_attach(struct vobject *obj, struct vobject *parent)
 		parent->list = obj;
 	parent->listlast = obj;
 	obj->parent = parent;
+	vobject_set_dirty(parent);
 }
 
 /* vprop hierarchy */
@@ -189,6 +795,12 @@ void vprop_detach(struct vprop *vp)
 		vp->prev->next = vp->next;
 	if (vp->next)
 		vp->next->prev = vp->prev;
+	if (vp->toplevel) {
+		vobject_props_changed(vproptovobject(vp));
+		vp->toplevel = 0;
+	} else if (vp->up && vp->up->toplevel)
+		/* metadata of a prop */
+		vobject_props_changed(vproptovobject(vp->up));
 	vp->prev = vp->next = vp->up = NULL;
 }
 
@@ -206,10 +818,12 @@ static void vprop_attach_vprop(struct vprop *vp, struct vprop *parent)
 
 static void vprop_attach(struct vprop *vp, struct vobject *vo)
 {
+	vobject_props_changed(vo);
 	/* give a fake parent vprop pointer from vobject,
 	 * so that vprop->sub actually points to vobject->props
 	 */
-	vprop_attach_vprop(vp, (struct vprop *)(((char *)&((vo)->props))-offsetof(struct vprop, sub)));
+	vprop_attach_vprop(vp, vobjecttovprop(vo));
+	vp->toplevel = 1;
 }
 
 struct vobject *vobject_first_child(const struct vobject *vo)
@@ -229,6 +843,7 @@ void vobject_sort_props(struct vobject *vo,
 	struct vprop *ref, *lp, *tmp;
 	if (!vo)
 		return;
+	vobject_props_changed(vo);
 	for (ref = vo->props; ref; ref = ref->next) {
 		for (lp = vo->proplast; lp != ref; lp = lp->prev) {
 			if (cmp(ref->key, lp->key) > 0) {
@@ -251,257 +866,1625 @@ void vobject_sort_props(struct vobject *vo,
 	}
 }
 
-/* free a vobject */
-static void vprop_free(struct vprop *vp)
+static const char *const vkind_names[] = {
+	[VK_VCALENDAR] = "VCALENDAR",
+	[VK_VCARD] = "VCARD",
+	[VK_VEVENT] = "VEVENT",
+	[VK_VTODO] = "VTODO",
+	[VK_VJOURNAL] = "VJOURNAL",
+	[VK_VFREEBUSY] = "VFREEBUSY",
+	[VK_VTIMEZONE] = "VTIMEZONE",
+	[VK_VALARM] = "VALARM",
+	[VK_STANDARD] = "STANDARD",
+	[VK_DAYLIGHT] = "DAYLIGHT",
+};
+
+/* create a vobject in @arena, or in a new arena */
+static struct vobject *vobject_alloc(struct arena *arena, const char *type)
 {
-	vprop_detach(vp);
-	while (vp->sub)
-		vprop_free(vp->sub);
-	if (vp->value)
-		free(vp->value);
-	free(vp);
+	struct vobject *vo;
+	int kind;
+
+	arena = arena ? arena_get(arena) : arena_new();
+	vo = arena_zalloc(arena, sizeof(*vo));
+	vo->arena = arena;
+	for (kind = VK_OTHER+1; kind < sizeof(vkind_names)/sizeof(vkind_names[0]); ++kind) {
+		if (!strcasecmp(vkind_names[kind], type))
+			break;
+	}
+	if (kind < sizeof(vkind_names)/sizeof(vkind_names[0])) {
+		vo->kind = kind;
+		/* keep the original spelling */
+		vo->type = strcmp(vkind_names[kind], type) ?
+			arena_strdup(arena, type) : vkind_names[kind];
+	} else
+		vo->type = arena_strdup(arena, type);
+	return vo;
 }
 
 /* free a vobject */
 void vobject_free(struct vobject *vc)
 {
-	while (vc->props)
-		vprop_free(vc->props);
+	struct arena *arena = vc->arena;
+
+	/* properties live in the arena, children may have their own */
 	while (vc->list)
 		vobject_free(vc->list);
 	vobject_detach(vc);
-	if (vc->type)
-		free(vc->type);
-	free(vc);
+	vobject_props_changed(vc);
+	arena_put(arena);
 }
 
 /* FILE INPUT */
-static char *strchresc(const char *str, int c)
+
+/*
+ * delimiter scanner
+ * Return the first occurence of @c, a quote, or the terminating 0.
+ * The vector versions use aligned loads, so they never cross a page
+ * boundary beyond the terminating 0. They may read beyond the end
+ * of a heap buffer, so ASAN must ignore them.
+ */
+static const char *scan_delim_scalar(const char *str, int c)
+{
+	for (; *str && *str != c && *str != '"' && *str != '\''; ++str);
+	return str;
+}
+
+#ifdef __SSE2__
+#include <immintrin.h>
+
+__attribute__((no_sanitize_address))
+static const char *scan_delim_sse2(const char *str, int c)
+{
+	const char *blk = (const char *)((unsigned long)str & ~15UL);
+	const __m128i vc = _mm_set1_epi8(c), vq = _mm_set1_epi8('"'),
+	      va = _mm_set1_epi8('\''), vz = _mm_setzero_si128();
+	__m128i dat;
+	unsigned int mask;
+
+	/* ignore the bytes before @str in the first block */
+	mask = ~0U << (str - blk);
+	for (;; blk += 16, mask = ~0U) {
+		dat = _mm_load_si128((const __m128i *)blk);
+		mask &= _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(dat, vc), _mm_cmpeq_epi8(dat, vz)),
+				_mm_or_si128(_mm_cmpeq_epi8(dat, vq), _mm_cmpeq_epi8(dat, va))));
+		if (mask)
+			return blk + __builtin_ctz(mask);
+	}
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *scan_delim_avx2(const char *str, int c)
+{
+	const char *blk = (const char *)((unsigned long)str & ~31UL);
+	const __m256i vc = _mm256_set1_epi8(c), vq = _mm256_set1_epi8('"'),
+	      va = _mm256_set1_epi8('\''), vz = _mm256_setzero_si256();
+	__m256i dat;
+	unsigned int mask;
+
+	mask = ~0U << (str - blk);
+	for (;; blk += 32, mask = ~0U) {
+		dat = _mm256_load_si256((const __m256i *)blk);
+		mask &= _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(dat, vc), _mm256_cmpeq_epi8(dat, vz)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(dat, vq), _mm256_cmpeq_epi8(dat, va))));
+		if (mask)
+			return blk + __builtin_ctz(mask);
+	}
+}
+#endif
+
+static const char *(*scan_delim)(const char *str, int c) = scan_delim_scalar;
+
+__attribute__((constructor))
+static void init_scan_delim(void)
 {
-	int esc = 0;
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_delim = scan_delim_avx2;
+	else
+		scan_delim = scan_delim_sse2;
+#endif
+}
 
-	for (; *str; ++str) {
-		if (esc) {
-			if (*str == esc)
-				esc = 0;
-		} else if (*str == c)
+static char *strchresc(const char *str, int c)
+{
+	for (;;) {
+		str = scan_delim(str, c);
+		if (*str == c)
 			return (char *)str;
-		else if (strchr("\"'", *str))
-			esc = *str;
+		else if (!*str)
+			return NULL;
+		/* skip quoted text */
+		str = strchr(str+1, *str);
+		if (!str)
+			return NULL;
+		++str;
 	}
-	return NULL;
 }
 
-static struct vprop *mkvprop(const char *key, const char *value)
+static struct vprop *mkvprop(struct arena *arena, const char *key,
+		char *value, int copy)
 {
 	struct vprop *vp;
+	size_t keylen = strlen(key);
 
-	vp = zalloc(sizeof(*vp) + strlen(key));
-	strcpy(vp->key, key);
+	vp = arena_zalloc(arena, sizeof(*vp) + keylen);
+	memcpy(vp->key, key, keylen+1);
+	vp->atom = vatom_lookup(key, 1);
 
+	/* refer to the input buffer when not copying */
 	if (value)
-		vp->value = strdup(value);
-	if (value && !vp->value)
-		elog(LOG_ERR, errno, "strdup");
+		vp->value = copy ? arena_strdup(arena, value) : value;
 	return vp;
 }
 
-static struct vprop *strtovprop(char *line)
+/* split the next KEY[=VALUE] from *@pmeta */
+static char *strtometa(char **pmeta, char **pvalue)
 {
-	struct vprop *vp;
-	char *value, *meta, *next, *end;
+	char *meta = *pmeta, *value, *end;
 
-	/* seperate value from key */
-	value = strchresc(line, ':');
-	if (value)
+	*pmeta = strchresc(meta, ';');
+	if (*pmeta)
+		*(*pmeta)++ = 0;
+	value = strchresc(meta, '=');
+	if (value) {
 		*value++ = 0;
+		end = value + strlen(value)-1;
+		if (strchr("\"'", *value) && (*value == *end)) {
+			++value;
+			*end = 0;
+		}
+	}
+	*pvalue = value;
+	return meta;
+}
+
+/* split KEY[;META]:VALUE, returns META */
+static char *strtokey(char *line, char **pvalue)
+{
+	char *meta;
+
+	/* seperate value from key */
+	*pvalue = strchresc(line, ':');
+	if (*pvalue)
+		*(*pvalue)++ = 0;
 
 	/* seperate meta from key */
 	meta = strchresc(line, ';');
 	if (meta)
 		*meta++ = 0;
+	return meta;
+}
 
+static struct vprop *strtovprop(struct arena *arena, char *line, int copy)
+{
+	struct vprop *vp;
+	char *value, *meta;
+
+	meta = strtokey(line, &value);
 	/* create vprop */
-	vp = mkvprop(line, value);
-
-	for (; meta; meta = next) {
-		next = strchresc(meta, ';');
-		if (next)
-			*next++ = 0;
-		value = strchresc(meta, '=');
-		if (value) {
-			*value++ = 0;
-			end = value + strlen(value)-1;
-			if (strchr("\"'", *value) && (*value == *end)) {
-				++value;
-				*end = 0;
-			}
-		}
-		vprop_attach_vprop(mkvprop(meta, value), vp);
-	}
+	vp = mkvprop(arena, line, value, copy);
+	/* most metadata is never used, parse it on first use */
+	if (meta)
+		vp->rawmeta = copy ? arena_strdup(arena, meta) : meta;
 	return vp;
 }
 
-/* read next vobject from file */
-struct vobject *vobject_next(FILE *fp, int *linenr)
+static void vprop_parse_meta(struct vprop *vp)
 {
-	char *line = NULL, *saved = NULL;
-	size_t linesize = 0, savedsize = 0, savedlen = 0;
-	int ret, mylinenr = 0;
-	struct vobject *vc = NULL;
-	struct vprop *vp;
+	char *meta = vp->rawmeta, *key, *value;
+	struct arena *arena;
 
-	if (!linenr)
-		linenr = &mylinenr;
+	/* only attached props know their arena */
+	if (!meta || !vp->up)
+		return;
+	vp->rawmeta = NULL;
+	arena = vproptovobject(vp)->arena;
+	while (meta) {
+		key = strtometa(&meta, &value);
+		vprop_attach_vprop(mkvprop(arena, key, value, 0), vp);
+	}
+}
 
-	while (1) {
-		ret = getline(&line, &linesize, fp);
-		if (ret < 0) {
-			if (vc)
-				elog(LOG_INFO, 0, "unexpected EOF on line %u", *linenr);
-			break;
-		}
-		++(*linenr);
-		while (ret && strchr("\r\n\v\f", line[ret-1]))
-			--ret;
-		line[ret] = 0;
-		if (strchr("\t ", *line)) {
-			/* add line to previous */
-			if (!saved || !*saved) {
-				elog(LOG_INFO, 0, "bad line %u", *linenr);
-				continue;
-			}
-			if (savedlen + ret -1 + 1 > savedsize) {
-				savedsize = (savedlen + ret - 1 + 1 + 63) & ~63;
-				saved = realloc(saved, savedsize);
-			}
-			strcpy(saved+savedlen, line+1);
-			savedlen += ret-1;
+/* characters that the parser strips from the line end */
+static inline int iseolchr(int c)
+{
+	return c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+/*
+ * read an out-of-line value from @fd, unfolded like the parser does,
+ * and pass it in pieces to @cb
+ */
+static int vlazy_read(const struct vlazy *lz, int fd,
+		void (*cb)(const char *dat, size_t len, void *arg), void *arg)
+{
+	char buf[16384], *str, *eol, *end, *next;
+	size_t skip = lz->skip, done, len, n;
+	ssize_t ret;
+	int bol = 0;
+
+	for (done = 0; done < lz->len; ) {
+		len = lz->len - done;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		ret = pread(fd, buf, len, lz->off + done);
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (!ret)
+			/* the file was truncated */
+			errno = EIO;
+		if (ret <= 0)
+			return -1;
+		end = buf + ret;
+		if (done + ret < lz->len) {
+			/* leave a partial line end for the next read */
+			for (; end > buf && iseolchr(end[-1]) && end[-1] != '\n'; --end);
+			if (end == buf)
+				end = buf + ret;
 		}
-		if (saved && *saved) {
-			/* append property */
-			if (vc) {
-				vp = strtovprop(saved);
-				if (vp)
-					vprop_attach(vp, vc);
+		done += end - buf;
+		/* unfold in place */
+		for (str = buf, n = 0; str < end; str = next) {
+			if (bol) {
+				bol = 0;
+				/* drop the folding whitespace */
+				if (*str == ' ' || *str == '\t') {
+					next = str+1;
+					continue;
+				}
 			}
-			/* erase saved stuff */
-			savedlen = 0;
-			*saved = 0;
-		}
-		/* fresh line, new property */
-		if (!strncasecmp(line, "BEGIN:", 6)) {
-			struct vobject *parent = vc;
-
-			/* create new/child VCard */
-			vc = zalloc(sizeof(*vc));
-			vc->type = strdup(line+6);
-			if (parent)
-				vobject_attach(vc, parent);
-			/* don't add this line */
-			continue;
-		} else if (vc && !strncasecmp(line, "END:", 4) &&
-				!strcasecmp(line+4, vc->type)) {
-			if (!vc->parent)
-				/* end this vobject */
-				break;
-			vc = vc->parent;
-			continue;
-		}
-		/* save line, we only know that a line finished on next line */
-		if (savedsize < ret+1) {
-			savedsize = (ret + 1 + 63) & ~63;
-			saved = realloc(saved, savedsize);
+			eol = memchr(str, '\n', end - str);
+			next = eol ? eol+1 : end;
+			if (eol) {
+				bol = 1;
+				for (; eol > str && iseolchr(eol[-1]); --eol);
+			} else
+				eol = end;
+			len = eol - str;
+			if (skip >= len) {
+				skip -= len;
+				continue;
+			}
+			str += skip;
+			len -= skip;
+			skip = 0;
+			memmove(buf + n, str, len);
+			n += len;
 		}
-		strcpy(saved, line);
-		savedlen = ret;
+		if (n)
+			cb(buf, n, arg);
 	}
-	if (saved)
-		free(saved);
-	if (line)
-		free(line);
-	return vc;
+	return 0;
 }
 
-static int appendprintf(char **pline, size_t *psize, size_t pos, const char *fmt, ...)
+/* collect an out-of-line value */
+struct vlazybuf {
+	char *dat;
+	size_t len;
+};
+
+static void vlazy_collect(const char *dat, size_t len, void *arg)
 {
-#define BLOCKSZ	64
-	int len;
-	char *printed;
-	va_list va;
+	struct vlazybuf *b = arg;
 
-	va_start(va, fmt);
-	len = vasprintf(&printed, fmt, va);
-	va_end(va);
+	memcpy(b->dat + b->len, dat, len);
+	b->len += len;
+}
 
-	if (len < 0)
-		return 0;
+static void vprop_read_lazy(struct vprop *vp)
+{
+	struct arena *arena = vproptovobject(vp)->arena;
+	struct vlazybuf b = {
+		/* the unfolded value is never longer */
+		.dat = arena_alloc2(arena, vp->lazy->len + 1, 1),
+	};
+
+	if (vlazy_read(vp->lazy, arena->src->fd, vlazy_collect, &b) < 0)
+		elog(LOG_INFO, errno, "read %s value", vp->key);
+	b.dat[b.len] = 0;
+	vp->value = b.dat;
+	vp->lazy = NULL;
+}
 
-	if ((pos + len + 1) > *psize) {
-		*psize = ((pos + len + 1) + BLOCKSZ -1) % ~(BLOCKSZ-1);
-		*pline = realloc(*pline, *psize);
+/*
+ * line parser, shared by the FILE and the in-memory parser
+ *
+ * For in-place parsing, @saved points into the input buffer,
+ * folded lines are joined by moving them back in the buffer.
+ *
+ * The streaming parser does not build vobjects, but keeps a stack
+ * of the open types, and the raw text of the toplevel vobject.
+ *
+ * Binary values that grow beyond @lazy bytes are not joined, only their
+ * range in @src is kept. Text values stay, to remain searchable.
+ * The streaming parser leaves their continuation lines out of the raw
+ * text, and remembers which props went out-of-line, so that
+ * the materialized vobject follows the same decisions.
+ */
+struct vparser {
+	struct vobject *vc;
+	char *saved;
+	size_t savedlen, savedsize;
+	int inplace;
+	int copy;
+
+	/* out-of-line values */
+	struct vsource *src;
+	size_t lazy;
+	off_t lineoff, savedoff, savedend;
+	int outofline;
+	int nprops;
+	struct vlazyprop {
+		int prop;
+		struct vlazy lz;
+	} *lazies;
+	int nlazies, slazies, ilazy;
+	/* remember the source text of toplevel vobjects */
+	int spans;
+	off_t beginoff;
+
+	/* streaming */
+	const struct vobject_sax *sax;
+	void *dat;
+	char *types;
+	size_t typeslen, typessize;
+	char *raw;
+	size_t rawlen, rawsize;
+	int done;
+};
+
+/* append to a growable buffer */
+static char *bufappend(char *buf, size_t *plen, size_t *psize,
+		const char *dat, size_t len)
+{
+	if (*plen + len > *psize) {
+		*psize = (*plen + len + 1023) & ~1023;
+		buf = realloc(buf, *psize);
+		if (!buf)
+			elog(LOG_ERR, errno, "realloc %zu", *psize);
 	}
-	strcpy((*pline) + pos, printed);
-	free(printed);
-	return len;
+	memcpy(buf + *plen, dat, len);
+	*plen += len;
+	return buf;
 }
 
-/* output vobjects, returns the number of ascii lines */
-int vobject_write2(const struct vobject *vc, FILE *fp, int flags)
+static void vparser_free(struct vparser *p)
+{
+	if (p->saved && !p->inplace)
+		free(p->saved);
+	if (p->types)
+		free(p->types);
+	if (p->raw)
+		free(p->raw);
+	/* a materializing parser borrows the lazies */
+	if (p->slazies)
+		free(p->lazies);
+	if (p->src)
+		vsource_put(p->src);
+}
+
+static void vparser_set_source(struct vparser *p, int fd, size_t threshold)
+{
+	if (p->src)
+		vsource_put(p->src);
+	p->src = vsource_new(fd);
+	p->lazy = threshold;
+}
+
+static struct vobject *vparse_mem(struct vparser *p, char **pdat, char *end,
+		int *linenr);
+
+/* emit a property to the streaming parser, without out-of-line value */
+static void vparser_sax_prop(struct vparser *p, char *line, int lazy)
+{
+	char *value, *meta, *key, *metavalue;
+
+	meta = strtokey(line, &value);
+	if (p->sax->prop)
+		p->sax->prop(line, lazy ? NULL : value, p->dat);
+	while (meta && p->sax->meta) {
+		key = strtometa(&meta, &metavalue);
+		p->sax->meta(line, key, metavalue, p->dat);
+	}
+}
+
+/* the current type of the streaming parser */
+static const char *vparser_sax_type(struct vparser *p)
+{
+	const char *type;
+
+	if (!p->typeslen)
+		return NULL;
+	/* skip the trailing 0 */
+	type = memrchr(p->types, 0, p->typeslen-1);
+	return type ? type+1 : p->types;
+}
+
+/*
+ * whether a property holds binary data, by its key or metadata
+ * @end is the ':' after the metadata
+ */
+static int vprop_isbinary(const char *str, const char *end)
+{
+	static const char *const keys[] = {
+		"PHOTO", "LOGO", "SOUND", "KEY", "ATTACH", NULL,
+	};
+	static const char *const metas[] = {
+		"ENCODING=B", "ENCODING=BASE64", "VALUE=BINARY", "BASE64", NULL,
+	};
+	const char *const *names = keys;
+	const char *dot;
+	size_t len;
+	int j;
+
+	for (; str < end; str += len+1, names = metas) {
+		len = strcspn(str, ";:");
+		if (str + len > end)
+			len = end - str;
+		if (names == keys && (dot = memchr(str, '.', len))) {
+			/* skip the group */
+			len -= dot+1 - str;
+			str = dot+1;
+		}
+		for (j = 0; names[j]; ++j) {
+			if (strlen(names[j]) == len && !strncasecmp(str, names[j], len))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * decide whether the saved property goes out-of-line,
+ * and drop its value from @saved then
+ */
+static struct vlazy *vparser_lazy(struct vparser *p, struct vlazy *lz)
+{
+	struct vlazyprop *lp;
+	char *value;
+	int prop = 0;
+
+	if (!p->src || (p->sax ? !p->typeslen : !p->vc))
+		return NULL;
+	/* only streamed vobjects number their props */
+	if (p->sax || !p->lazy)
+		prop = p->nprops++;
+	if (!p->lazy) {
+		/* materializing a streamed vobject, follow its decisions */
+		if (p->ilazy >= p->nlazies || p->lazies[p->ilazy].prop != prop)
+			return NULL;
+		*lz = p->lazies[p->ilazy++].lz;
+		value = strchresc(p->saved, ':');
+	} else {
+		if (!p->outofline && p->savedlen <= p->lazy)
+			return NULL;
+		value = strchresc(p->saved, ':');
+		if (!value || (!p->outofline && !vprop_isbinary(p->saved, value)))
+			return NULL;
+		lz->off = p->savedoff;
+		lz->len = p->savedend - p->savedoff;
+		lz->skip = value+1 - p->saved;
+		if (p->sax) {
+			if (p->nlazies >= p->slazies) {
+				p->slazies = p->slazies*2 ?: 16;
+				p->lazies = realloc(p->lazies,
+						p->slazies*sizeof(*p->lazies));
+				if (!p->lazies)
+					elog(LOG_ERR, errno, "realloc");
+			}
+			lp = &p->lazies[p->nlazies++];
+			lp->prop = prop;
+			lp->lz = *lz;
+		}
+	}
+	if (value)
+		value[1] = 0;
+	return lz;
+}
+
+/* turn a parsed property into an out-of-line one */
+static void vparser_set_lazy(struct vparser *p, struct vprop *vp,
+		const struct vlazy *lz)
+{
+	struct arena *arena = p->vc->arena;
+
+	vp->value = NULL;
+	vp->lazy = arena_alloc2(arena, sizeof(*lz), sizeof(off_t));
+	*vp->lazy = *lz;
+	if (!arena->src)
+		arena->src = vsource_get(p->src);
+}
+
+/* add the saved property, its line is complete */
+static void vparser_flush(struct vparser *p)
+{
+	struct vprop *vp;
+	struct vlazy lz, *plz;
+
+	if (!p->savedlen)
+		return;
+	p->saved[p->savedlen] = 0;
+	plz = vparser_lazy(p, &lz);
+	if (p->sax) {
+		if (p->typeslen)
+			vparser_sax_prop(p, p->saved, !!plz);
+	} else if (p->vc) {
+		vp = strtovprop(p->vc->arena, p->saved, p->copy);
+		if (vp && plz)
+			vparser_set_lazy(p, vp, plz);
+		if (vp)
+			vprop_attach(vp, p->vc);
+	}
+	/* erase saved stuff */
+	p->savedlen = 0;
+	p->outofline = 0;
+}
+
+/*
+ * process 1 physical line, @line[@len] must be 0
+ * returns the toplevel vobject when it finished
+ */
+static struct vobject *vparser_line(struct vparser *p, char *line, size_t len,
+		int linenr)
+{
+	struct vobject *vc;
+	const char *type;
+	char *value;
+
+	if (p->sax && (p->typeslen || !strncasecmp(line, "BEGIN:", 6)) &&
+			!(p->outofline && len && strchr("\t ", *line))) {
+		/* keep the raw text of the toplevel vobject */
+		p->raw = bufappend(p->raw, &p->rawlen, &p->rawsize, line, len);
+		p->raw = bufappend(p->raw, &p->rawlen, &p->rawsize, "\n", 1);
+	}
+	if (!len || strchr("\t ", *line)) {
+		/* add line to previous */
+		if (!p->saved || !p->savedlen) {
+			elog(LOG_INFO, 0, "bad line %u", linenr);
+			return NULL;
+		}
+		if (!len)
+			return NULL;
+		if (p->outofline) {
+			/* only extend the range */
+			p->savedend = p->lineoff + len;
+			return NULL;
+		}
+		if (p->lazy && p->savedlen + len-1 > p->lazy) {
+			p->saved[p->savedlen] = 0;
+			/* the key & metadata must be complete */
+			value = strchresc(p->saved, ':');
+			if (value && vprop_isbinary(p->saved, value)) {
+				p->outofline = 1;
+				p->savedend = p->lineoff + len;
+				return NULL;
+			}
+		}
+		if (!p->inplace && p->savedlen + len -1 + 1 > p->savedsize) {
+			/* grow geometrically, folded values can be huge */
+			p->savedsize = (p->savedlen + len - 1 + 1) * 2;
+			p->saved = realloc(p->saved, p->savedsize);
+			if (!p->saved)
+				elog(LOG_ERR, errno, "realloc %zu", p->savedsize);
+		}
+		memmove(p->saved+p->savedlen, line+1, len-1);
+		p->savedlen += len-1;
+		p->savedend = p->lineoff + len;
+		return NULL;
+	}
+	vparser_flush(p);
+	/* fresh line, new property */
+	if (p->sax && !strncasecmp(line, "BEGIN:", 6)) {
+		if (!p->typeslen)
+			/* new toplevel vobject */
+			p->nprops = p->nlazies = 0;
+		p->types = bufappend(p->types, &p->typeslen, &p->typessize,
+				line+6, len-6+1);
+		if (p->sax->begin)
+			p->sax->begin(line+6, p->dat);
+		return NULL;
+	} else if (p->sax && (type = vparser_sax_type(p)) &&
+			!strncasecmp(line, "END:", 4) && !strcasecmp(line+4, type)) {
+		p->typeslen = type - p->types;
+		if (!(p->sax->end ? p->sax->end(line+4, p->dat) : 0) ||
+				p->typeslen) {
+			if (!p->typeslen)
+				/* toplevel vobject done */
+				p->done = 1;
+			return NULL;
+		}
+		/* materialize the toplevel vobject from its raw text */
+		struct vparser sub = {
+			.inplace = 1,
+			.copy = 1,
+			.src = p->src ? vsource_get(p->src) : NULL,
+			.lazies = p->lazies,
+			.nlazies = p->nlazies,
+		};
+		char *dat = p->raw;
+		int sublinenr = 0;
+
+		vc = vparse_mem(&sub, &dat, p->raw + p->rawlen, &sublinenr);
+		vparser_free(&sub);
+		p->rawlen = 0;
+		if (vc && p->sax->built)
+			p->sax->built(vc, p->dat);
+		return vc;
+	} else if (!strncasecmp(line, "BEGIN:", 6)) {
+		struct vobject *parent = p->vc;
+
+		/* create new/child VCard, children share the arena */
+		p->vc = vobject_alloc(parent ? parent->arena : NULL, line+6);
+		if (parent)
+			vobject_attach(p->vc, parent);
+		else
+			p->beginoff = p->lineoff;
+		/* don't add this line */
+		return NULL;
+	} else if (p->vc && !strncasecmp(line, "END:", 4) &&
+			!strcasecmp(line+4, p->vc->type)) {
+		vc = p->vc;
+		p->vc = vc->parent;
+		if (p->vc)
+			return NULL;
+		if (p->spans) {
+			vc->raw.off = p->beginoff;
+			vc->raw.len = p->lineoff + len - p->beginoff;
+			vc->dirty = 0;
+			if (!vc->arena->src)
+				vc->arena->src = vsource_get(p->src);
+		}
+		/* return when this vobject ended */
+		return vc;
+	}
+	/* save line, we only know that a line finished on next line */
+	p->savedoff = p->lineoff;
+	p->savedend = p->lineoff + len;
+	if (p->inplace) {
+		p->saved = line;
+	} else {
+		if (p->savedsize < len+1) {
+			p->savedsize = (len + 1 + 63) & ~63;
+			p->saved = realloc(p->saved, p->savedsize);
+		}
+		memcpy(p->saved, line, len);
+	}
+	p->savedlen = len;
+	return NULL;
+}
+
+/* finish parsing at EOF */
+static struct vobject *vparser_eof(struct vparser *p, int linenr)
+{
+	struct vobject *vc;
+
+	if (!p->vc && !p->typeslen)
+		return NULL;
+	elog(LOG_INFO, 0, "unexpected EOF on line %u", linenr);
+	if (!p->vc)
+		return NULL;
+	/* return incomplete vobject */
+	for (vc = p->vc; vc->parent; vc = vc->parent);
+	p->vc = NULL;
+	return vc;
+}
+
+/*
+ * reader, keeps the parser buffers between vobjects
+ * It reads from a FILE, or with large read() calls from a file descriptor.
+ */
+struct vobject_reader {
+	FILE *fp;
+	int fd;
+	int eof;
+	int linenr;
+	/* FILE: getline buffer, fd: block buffer */
+	char *line;
+	size_t linesize;
+	size_t head, fill;
+	/* file offset of the block buffer */
+	off_t bufoff;
+	struct vparser p;
+};
+
+struct vobject_reader *vobject_reader_new(FILE *fp)
+{
+	struct vobject_reader *rd;
+
+	rd = zalloc(sizeof(*rd));
+	rd->fp = fp;
+	rd->fd = -1;
+	rd->p.copy = 1;
+	return rd;
+}
+
+#define VOBJECT_BLKSZ	(1024*1024)
+
+struct vobject_reader *vobject_reader_fd(int fd, size_t blocksize)
+{
+	struct vobject_reader *rd;
+	struct stat st;
+
+	rd = zalloc(sizeof(*rd));
+	rd->fd = fd;
+	rd->p.copy = 1;
+	rd->linesize = blocksize ?: VOBJECT_BLKSZ;
+	rd->line = malloc(rd->linesize);
+	if (!rd->line)
+		elog(LOG_ERR, errno, "malloc %zu", rd->linesize);
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return rd;
+}
+
+static int vreader_set_source(struct vobject_reader *rd, size_t threshold)
+{
+	off_t off;
+	int fd;
+
+	if (rd->fd < 0) {
+		/* FILE readers do not know the offsets */
+		errno = EINVAL;
+		return -1;
+	}
+	off = lseek(rd->fd, 0, SEEK_CUR);
+	if (off < 0)
+		return -1;
+	fd = dup(rd->fd);
+	if (fd < 0)
+		return -1;
+	rd->bufoff = off - rd->fill;
+	vparser_set_source(&rd->p, fd, threshold);
+	return 0;
+}
+
+int vobject_reader_lazy(struct vobject_reader *rd, size_t threshold)
+{
+	return vreader_set_source(rd, threshold);
+}
+
+int vobject_reader_raw(struct vobject_reader *rd)
+{
+	/* keep a lazy threshold */
+	if (!rd->p.src && vreader_set_source(rd, SIZE_MAX) < 0)
+		return -1;
+	rd->p.spans = 1;
+	return 0;
+}
+
+void vobject_reader_free(struct vobject_reader *rd)
+{
+	vparser_free(&rd->p);
+	if (rd->line)
+		free(rd->line);
+	free(rd);
+}
+
+int vobject_reader_linenr(const struct vobject_reader *rd)
+{
+	return rd->linenr;
+}
+
+/* return the next line from the block buffer, without newline */
+static char *vreader_fdline(struct vobject_reader *rd, size_t *plen)
+{
+	char *line, *eol;
+	ssize_t ret;
+
+	for (;;) {
+		line = rd->line + rd->head;
+		eol = memchr(line, '\n', rd->fill - rd->head);
+		if (eol) {
+			rd->head = eol + 1 - rd->line;
+			*plen = eol - line;
+			return line;
+		} else if (rd->eof) {
+			if (rd->head >= rd->fill)
+				return NULL;
+			/* last line without newline, a byte is reserved for the 0 */
+			*plen = rd->fill - rd->head;
+			rd->head = rd->fill;
+			return line;
+		} else if (rd->fd < 0)
+			/* push parser, wait for more data */
+			return NULL;
+		/* move the incomplete line to the start */
+		memmove(rd->line, line, rd->fill - rd->head);
+		rd->fill -= rd->head;
+		rd->bufoff += rd->head;
+		rd->head = 0;
+		if (rd->fill + 1 >= rd->linesize) {
+			/* line exceeds the buffer */
+			rd->linesize *= 2;
+			rd->line = realloc(rd->line, rd->linesize);
+			if (!rd->line)
+				elog(LOG_ERR, errno, "realloc %zu", rd->linesize);
+		}
+		ret = read(rd->fd, rd->line + rd->fill, rd->linesize - 1 - rd->fill);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			elog(LOG_INFO, errno, "read");
+		if (ret <= 0)
+			rd->eof = 1;
+		else
+			rd->fill += ret;
+	}
+}
+
+/* process 1 line, with a newline, and room to put a 0 */
+static struct vobject *vreader_line(struct vobject_reader *rd, char *line,
+		size_t len)
+{
+	++rd->linenr;
+	rd->p.lineoff = rd->bufoff + (line - rd->line);
+	while (len && strchr("\r\n\v\f", line[len-1]))
+		--len;
+	line[len] = 0;
+	return vparser_line(&rd->p, line, len, rd->linenr);
+}
+
+static struct vobject *vparse_file(struct vobject_reader *rd)
+{
+	struct vparser *p = &rd->p;
+	char *line;
+	size_t len;
+	int ret;
+	struct vobject *vc = NULL;
+
+	/* start a fresh vobject, but keep the buffers */
+	p->vc = NULL;
+	p->savedlen = p->typeslen = p->rawlen = 0;
+	p->outofline = p->nprops = 0;
+	p->done = 0;
+
+	while (!vc && !p->done) {
+		if (rd->fp) {
+			ret = getline(&rd->line, &rd->linesize, rd->fp);
+			line = rd->line;
+			len = ret;
+		} else {
+			line = vreader_fdline(rd, &len);
+			ret = line ? 0 : -1;
+		}
+		if (ret < 0) {
+			vc = vparser_eof(p, rd->linenr);
+			break;
+		}
+		vc = vreader_line(rd, line, len);
+	}
+	return vc;
+}
+
+/* parse lines from memory, until a toplevel vobject is complete */
+static struct vobject *vparse_lines(struct vparser *p, char **pdat, char *end,
+		int *linenr)
+{
+	char *line, *eol, *next;
+	size_t len;
+	struct vobject *vc = NULL;
+
+	for (line = *pdat; !vc && !p->done && line < end; line = next) {
+		eol = memchr(line, '\n', end - line);
+		next = eol ? eol+1 : end;
+		if (!eol)
+			eol = end;
+		++(*linenr);
+		len = eol - line;
+		while (len && strchr("\r\n\v\f", line[len-1]))
+			--len;
+		if (line + len < end) {
+			line[len] = 0;
+			vc = vparser_line(p, line, len, *linenr);
+		} else {
+			/* last line lacks a newline, and has no room for a 0 */
+			char *tmp = strndup(line, len);
+
+			vc = vparser_line(p, tmp, len, *linenr);
+			if (p->saved == tmp)
+				/* the pending line is never used anymore */
+				p->saved = NULL;
+			free(tmp);
+		}
+	}
+	*pdat = line;
+	return vc;
+}
+
+static struct vobject *vparse_mem(struct vparser *p, char **pdat, char *end,
+		int *linenr)
+{
+	int mylinenr = 0;
+	struct vobject *vc;
+
+	if (!linenr)
+		linenr = &mylinenr;
+
+	vc = vparse_lines(p, pdat, end, linenr);
+	if (!vc && !p->done && *pdat >= end)
+		vc = vparser_eof(p, *linenr);
+	return vc;
+}
+
+struct vobject *vobject_reader_next(struct vobject_reader *rd)
+{
+	rd->p.sax = NULL;
+	return vparse_file(rd);
+}
+
+/* stream the next toplevel vobject */
+int vobject_reader_sax(struct vobject_reader *rd, const struct vobject_sax *cb,
+		void *dat, struct vobject **pvc)
+{
+	struct vobject *vc;
+
+	rd->p.sax = cb;
+	rd->p.dat = dat;
+	vc = vparse_file(rd);
+	if (pvc)
+		*pvc = vc;
+	else if (vc)
+		vobject_free(vc);
+	return vc || rd->p.done;
+}
+
+/* read next vobject from file, with a temporary reader */
+struct vobject *vobject_next(FILE *fp, int *linenr)
+{
+	struct vobject_reader *rd;
+	struct vobject *vc;
+
+	rd = vobject_reader_new(fp);
+	rd->linenr = linenr ? *linenr : 0;
+	vc = vobject_reader_next(rd);
+	if (linenr)
+		*linenr = rd->linenr;
+	vobject_reader_free(rd);
+	return vc;
+}
+
+/* read next vobject from memory, in-place */
+struct vobject *vobject_next_mem(char **pdat, char *end, int *linenr)
+{
+	struct vparser p = { .inplace = 1, };
+	struct vobject *vc;
+
+	vc = vparse_mem(&p, pdat, end, linenr);
+	vparser_free(&p);
+	return vc;
+}
+
+int vobject_sax(FILE *fp, int *linenr, const struct vobject_sax *cb, void *dat,
+		struct vobject **pvc)
+{
+	struct vobject_reader *rd;
+	int ret;
+
+	rd = vobject_reader_new(fp);
+	rd->linenr = linenr ? *linenr : 0;
+	ret = vobject_reader_sax(rd, cb, dat, pvc);
+	if (linenr)
+		*linenr = rd->linenr;
+	vobject_reader_free(rd);
+	return ret;
+}
+
+/*
+ * push parser
+ * This is a reader without file, that gets its data fed.
+ * It queues completed vobjects until they are taken.
+ */
+struct vobject_parser {
+	struct vobject_reader rd;
+	struct vobject **queue;
+	int head, fill, size;
+};
+
+struct vobject_parser *vobject_parser_new(void)
+{
+	struct vobject_parser *vp;
+
+	vp = zalloc(sizeof(*vp));
+	vp->rd.fd = -1;
+	vp->rd.p.copy = 1;
+	vp->rd.linesize = 4096;
+	vp->rd.line = malloc(vp->rd.linesize);
+	if (!vp->rd.line)
+		elog(LOG_ERR, errno, "malloc %zu", vp->rd.linesize);
+	return vp;
+}
+
+void vobject_parser_free(struct vobject_parser *vp)
+{
+	struct vobject *vc;
+
+	while ((vc = vobject_parser_take(vp)) != NULL)
+		vobject_free(vc);
+	if (vp->queue)
+		free(vp->queue);
+	vparser_free(&vp->rd.p);
+	free(vp->rd.line);
+	free(vp);
+}
+
+static void vobject_parser_queue(struct vobject_parser *vp, struct vobject *vc)
+{
+	if (vp->head && vp->fill >= vp->size) {
+		/* reclaim taken entries */
+		memmove(vp->queue, vp->queue + vp->head,
+				(vp->fill - vp->head)*sizeof(*vp->queue));
+		vp->fill -= vp->head;
+		vp->head = 0;
+	}
+	if (vp->fill >= vp->size) {
+		vp->size = vp->size*2 ?: 16;
+		vp->queue = realloc(vp->queue, vp->size*sizeof(*vp->queue));
+		if (!vp->queue)
+			elog(LOG_ERR, errno, "realloc");
+	}
+	vp->queue[vp->fill++] = vc;
+}
+
+int vobject_parser_feed(struct vobject_parser *vp, const void *dat, size_t len)
+{
+	struct vobject_reader *rd = &vp->rd;
+	struct vobject *vc;
+	char *line;
+	size_t linelen;
+
+	if (!len)
+		rd->eof = 1;
+	/* drop the consumed data */
+	memmove(rd->line, rd->line + rd->head, rd->fill - rd->head);
+	rd->fill -= rd->head;
+	rd->bufoff += rd->head;
+	rd->head = 0;
+	if (rd->fill + len + 1 > rd->linesize) {
+		while (rd->fill + len + 1 > rd->linesize)
+			rd->linesize *= 2;
+		rd->line = realloc(rd->line, rd->linesize);
+		if (!rd->line)
+			elog(LOG_ERR, errno, "realloc %zu", rd->linesize);
+	}
+	if (len)
+		memcpy(rd->line + rd->fill, dat, len);
+	rd->fill += len;
+
+	while ((line = vreader_fdline(rd, &linelen)) != NULL) {
+		vc = vreader_line(rd, line, linelen);
+		if (vc)
+			vobject_parser_queue(vp, vc);
+		if (rd->p.done) {
+			/* streamed toplevel vobject, without result */
+			rd->p.done = 0;
+			rd->p.rawlen = 0;
+		}
+	}
+	if (rd->eof) {
+		vc = vparser_eof(&rd->p, rd->linenr);
+		if (vc)
+			vobject_parser_queue(vp, vc);
+	}
+	return vp->fill - vp->head;
+}
+
+int vobject_parser_lazy(struct vobject_parser *vp, int fd, size_t threshold)
+{
+	fd = dup(fd);
+	if (fd < 0)
+		return -1;
+	vparser_set_source(&vp->rd.p, fd, threshold);
+	return 0;
+}
+
+void vobject_parser_sax(struct vobject_parser *vp, const struct vobject_sax *cb,
+		void *dat)
+{
+	vp->rd.p.sax = cb;
+	vp->rd.p.dat = dat;
+}
+
+struct vobject *vobject_parser_take(struct vobject_parser *vp)
+{
+	if (vp->head >= vp->fill)
+		return NULL;
+	return vp->queue[vp->head++];
+}
+
+/* map a file private & writable, for vobject_next_mem */
+char *vobject_mmap(int fd, size_t *plen)
+{
+	struct stat st;
+	char *dat;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+	*plen = 0;
+	if (!S_ISREG(st.st_mode)) {
+		/* pipes & alike need a reader */
+		errno = ESPIPE;
+		return NULL;
+	}
+	if (!st.st_size)
+		/* mmap refuses empty files */
+		return NULL;
+	*plen = st.st_size;
+	dat = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (dat == MAP_FAILED)
+		return NULL;
+	madvise(dat, st.st_size, MADV_SEQUENTIAL);
+	return dat;
+}
+
+void vobject_munmap(char *dat, size_t len)
+{
+	if (len)
+		munmap(dat, len);
+}
+
+/*
+ * output sink
+ * The writers fill its buffer, which is written with large writes,
+ * or grows for memory sinks.
+ * The raw text of unmodified vobjects is refolded while it is copied
+ * into the buffer too, so all pending output is contiguous, and
+ * 1 write(2) flushes what writev(2) would gather from segments.
+ * Counting sinks only copy what fits in @out, and count the rest.
+ * An I/O error sticks in @err, the writers return it.
+ */
+struct vobject_sink {
+	int fd;
+	FILE *fp;
+	char *buf;
+	size_t size, fill;
+	int count;
+	char *out;
+	size_t outlen, total;
+	/* @buf belongs to the caller, it cannot grow */
+	int fixed;
+	int err;
+};
+
+#define VSINK_SIZE	(256*1024)
+/* write after a vobject, when this much is waiting */
+#define VSINK_FLUSH	(64*1024)
+
+static struct vobject_sink *vsink_new(int fd, FILE *fp)
+{
+	struct vobject_sink *s;
+
+	s = zalloc(sizeof(*s));
+	s->fd = fd;
+	s->fp = fp;
+	s->size = VSINK_SIZE;
+	s->buf = malloc(s->size);
+	if (!s->buf)
+		elog(LOG_ERR, errno, "malloc %zu", s->size);
+	return s;
+}
+
+struct vobject_sink *vobject_sink_fd(int fd)
+{
+	return vsink_new(fd, NULL);
+}
+
+struct vobject_sink *vobject_sink_file(FILE *fp)
+{
+	return vsink_new(-1, fp);
+}
+
+struct vobject_sink *vobject_sink_mem(void)
+{
+	return vsink_new(-1, NULL);
+}
+
+const char *vobject_sink_data(const struct vobject_sink *s, size_t *plen)
+{
+	*plen = s->fill;
+	return s->buf;
+}
+
+static inline int vsink_ismem(const struct vobject_sink *s)
+{
+	return s->fd < 0 && !s->fp && !s->count;
+}
+
+/* write the first @len bytes of the buffer */
+static void vsink_write(struct vobject_sink *s, size_t len)
+{
+	size_t done;
+	ssize_t ret;
+
+	if (vsink_ismem(s) || !len)
+		return;
+	if (s->err)
+		/* drop the output after an error */;
+	else if (s->count) {
+		if (s->total < s->outlen)
+			memcpy(s->out + s->total, s->buf, (s->outlen - s->total < len) ?
+					s->outlen - s->total : len);
+		s->total += len;
+	} else if (s->fp) {
+		if (fwrite(s->buf, len, 1, s->fp) != 1)
+			s->err = errno ?: EIO;
+	} else for (done = 0; done < len; done += ret) {
+		ret = write(s->fd, s->buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0) {
+			s->err = errno;
+			break;
+		}
+	}
+	memmove(s->buf, s->buf + len, s->fill - len);
+	s->fill -= len;
+}
+
+/* return the error of a sink, like the writers */
+static int vsink_error(const struct vobject_sink *s)
+{
+	if (!s->err)
+		return 0;
+	errno = s->err;
+	return -1;
+}
+
+int vobject_sink_flush(struct vobject_sink *s)
+{
+	vsink_write(s, s->fill);
+	if (s->fp && fflush(s->fp) && !s->err)
+		s->err = errno;
+	return vsink_error(s);
+}
+
+void vobject_sink_free(struct vobject_sink *s)
+{
+	if (!s)
+		return;
+	vobject_sink_flush(s);
+	free(s->buf);
+	free(s);
+}
+
+/*
+ * folding writer
+ * The bytes are copied into the sink buffer, and folded on the way.
+ * The buffer keeps the current physical line, so that a fold can move
+ * back to the start of a UTF-8 sequence.
+ */
+struct vfold {
+	struct vobject_sink *s;
+	int flags;
+	int nlines;
+	/* octets per physical line, without newline */
+	size_t width;
+	/* the current physical line is a continuation */
+	int cont;
+	size_t linestart;
+	/* keep the output from here in the sink, to undo it */
+	size_t mark;
+};
+
+#define VFOLD_WIDTH	80
+#define VFOLD_NOMARK	((size_t)-1)
+/* a UTF-8 fold moves back at most this much */
+#define VFOLD_UTF8_BACK	8
+
+/*
+ * the number of continuation bytes at @next and before, up to @max,
+ * i.e. how far to move a fold before @next back to a UTF-8 start byte
+ * @next[-15] must be readable.
+ * This probes 16 bytes at each fold point, rather than classifying all
+ * bytes in 1 pass: folds are at least 16 bytes apart, so the probe reads
+ * no more bytes than such a pass, and about 1/5 at the default width.
+ * The bytes in between are only copied.
+ */
+static inline size_t utf8_backoff(const char *next, size_t max)
+{
+	size_t n;
+#ifdef __SSE2__
+	__m128i dat = _mm_loadu_si128((const __m128i *)(next - 15));
+	/* continuation bytes are 10xxxxxx, below -64 as signed char */
+	unsigned int cont = _mm_movemask_epi8(_mm_cmplt_epi8(dat,
+				_mm_set1_epi8(-64)));
+
+	/* bit 15 is @next, count the set bits downwards */
+	n = __builtin_clz((~cont << 16) | 0x8000);
+#else
+	for (n = 0; n < max && (next[-n] & 0xc0) == 0x80; ++n);
+#endif
+	return n < max ? n : max;
+}
+
+/* make room in the sink */
+static void vfold_flush(struct vfold *w)
+{
+	struct vobject_sink *s = w->s;
+	size_t len = (w->flags & VOF_NOBREAK) ? s->fill : w->linestart;
+
+	if (len > w->mark && !s->fixed)
+		len = w->mark;
+	if (vsink_ismem(s) || !len) {
+		s->size *= 2;
+		s->buf = realloc(s->buf, s->size);
+		if (!s->buf)
+			elog(LOG_ERR, errno, "realloc %zu", s->size);
+		return;
+	}
+	vsink_write(s, len);
+	w->linestart -= len;
+	if (w->mark != VFOLD_NOMARK)
+		w->mark = (len <= w->mark) ? w->mark - len : VFOLD_NOMARK;
+}
+
+static void vfold_newline(struct vfold *w)
+{
+	struct vobject_sink *s = w->s;
+
+	if (w->flags & VOF_CRNL)
+		s->buf[s->fill++] = '\r';
+	s->buf[s->fill++] = '\n';
+	++w->nlines;
+}
+
+/* fold before @next */
+static void vfold_break(struct vfold *w, int next)
+{
+	struct vobject_sink *s = w->s;
+	char *line;
+	size_t len, todo, keep, nl = (w->flags & VOF_CRNL) ? 2 : 1;
+
+	if (s->fill + 3 > s->size)
+		vfold_flush(w);
+	line = s->buf + w->linestart + w->cont;
+	len = todo = s->fill - w->linestart - w->cont;
+	if (w->flags & VOF_UTF8) {
+		/* break on a start byte, but keep most of the line */
+		while (todo > w->width - VFOLD_UTF8_BACK && (next & 0xc0) == 0x80)
+			next = line[--todo];
+	}
+	/* move the tail to the next line */
+	keep = len - todo;
+	memmove(line + todo + nl + 1, line + todo, keep);
+	s->fill = line + todo - s->buf;
+	vfold_newline(w);
+	s->buf[s->fill++] = ' ';
+	w->linestart = s->fill - 1;
+	s->fill += keep;
+	w->cont = 1;
+}
+
+static void vfold_put(struct vfold *w, const char *dat, size_t len)
+{
+	struct vobject_sink *s = w->s;
+	size_t n, room;
+
+	while (len) {
+		n = s->size - s->fill;
+		if (!(w->flags & VOF_NOBREAK)) {
+			if (s->fill - w->linestart >= w->width) {
+				vfold_break(w, *dat);
+				continue;
+			}
+			room = w->width - (s->fill - w->linestart);
+			if (len > room && room >= 16 && n >= room + 3) {
+				/* the fold is inside @dat, copy up to it */
+				if (w->flags & VOF_UTF8)
+					room -= utf8_backoff(dat + room,
+							VFOLD_UTF8_BACK - w->cont);
+				memcpy(s->buf + s->fill, dat, room);
+				s->fill += room;
+				vfold_newline(w);
+				s->buf[s->fill++] = ' ';
+				w->linestart = s->fill - 1;
+				w->cont = 1;
+				dat += room;
+				len -= room;
+				continue;
+			}
+			if (n > room)
+				n = room;
+		}
+		if (!n) {
+			vfold_flush(w);
+			continue;
+		}
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->fill, dat, n);
+		s->fill += n;
+		dat += n;
+		len -= n;
+	}
+}
+
+static inline void vfold_puts(struct vfold *w, const char *str)
+{
+	vfold_put(w, str, strlen(str));
+}
+
+/* end the logical line */
+static void vfold_end(struct vfold *w)
+{
+	if (w->s->fill + 2 > w->s->size)
+		vfold_flush(w);
+	vfold_newline(w);
+	w->linestart = w->s->fill;
+	w->cont = 0;
+}
+
+/* stream a piece of an out-of-line value */
+static void vfold_append(const char *dat, size_t len, void *arg)
+{
+	vfold_put(arg, dat, len);
+}
+
+/* copy the source text of an unmodified vobject, refolded */
+static int vfold_raw(struct vfold *w, const struct vobject *vc)
+{
+	char buf[16384], *str, *eol, *end, *next;
+	const struct vlazy *lz = &vc->raw;
+	size_t done, len;
+	ssize_t ret;
+	int bol = 1, first = 1, nl;
+
+	for (done = 0; done < lz->len; done += end - buf) {
+		len = lz->len - done;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		ret = pread(vc->arena->src->fd, buf, len, lz->off + done);
+		if (ret < 0 && errno == EINTR) {
+			end = buf;
+			continue;
+		}
+		if (!ret)
+			/* the file was truncated */
+			errno = EIO;
+		if (ret <= 0)
+			return -1;
+		end = buf + ret;
+		if (done + ret < lz->len) {
+			/* leave a partial line end for the next read */
+			for (; end > buf && iseolchr(end[-1]) && end[-1] != '\n'; --end);
+			if (end == buf)
+				end = buf + ret;
+		}
+		for (str = buf; str < end; str = next) {
+			eol = memchr(str, '\n', end - str);
+			next = eol ? eol+1 : end;
+			nl = !!eol;
+			if (!eol)
+				eol = end;
+			for (; eol > str && iseolchr(eol[-1]); --eol);
+			if (bol && str < eol) {
+				if (*str == ' ' || *str == '\t')
+					/* drop the folding whitespace */
+					++str;
+				else if (!first)
+					vfold_end(w);
+				first = 0;
+			}
+			vfold_put(w, str, eol - str);
+			bol = nl;
+		}
+	}
+	if (!first)
+		vfold_end(w);
+	return 0;
+}
+
+static void vfold_vobject(struct vfold *w, const struct vobject *vc)
 {
-	int nlines = 0;
 	struct vprop *vp, *meta;
-	char *line = NULL;
-	size_t linesize = 0, fill, pos, todo;
 	const struct vobject *child;
-	const char *newline = (flags & VOF_CRNL) ? "\r\n" : "\n";
-
-	fprintf(fp, "BEGIN:%s%s", vc->type, newline);
-	++nlines;
+	int nlines = w->nlines, ret;
+	size_t mark;
+
+	if (vc->raw.len && !vc->dirty) {
+		w->mark = w->s->fill;
+		ret = vfold_raw(w, vc);
+		mark = w->mark;
+		w->mark = VFOLD_NOMARK;
+		if (!ret)
+			return;
+		if (mark == VFOLD_NOMARK) {
+			/* part of it is written already, fail the writer */
+			if (!w->s->err)
+				w->s->err = errno;
+			return;
+		}
+		elog(LOG_INFO, errno, "read %s source", vc->type);
+		/* undo the partial copy */
+		w->s->fill = w->linestart = mark;
+		w->cont = 0;
+		w->nlines = nlines;
+	}
+	vfold_puts(w, "BEGIN:");
+	vfold_puts(w, vc->type);
+	vfold_end(w);
 
 	/* iterate over all properties */
 	for (vp = vc->props; vp; vp = vp->next) {
-		fill = appendprintf(&line, &linesize, 0, "%s", vp->key);
-		for (meta = vp->sub; meta; meta = meta->next)
-			fill += appendprintf(&line, &linesize, fill,
-					strpbrk(meta->value, ":;") ? ";%s=\"%s\"" : ";%s=%s",
-					meta->key, meta->value);
-		fill += appendprintf(&line, &linesize, fill, ":%s", vp->value);
-
-		if (flags & VOF_NOBREAK) {
-			fputs(line, fp);
-			fputs(newline, fp);
-			++nlines;
-		} else
-		for (pos = 0; pos < fill; pos += todo) {
-			todo = pos ? 79 : 80;
-			if (pos + todo >= fill)
-				todo = fill - pos;
-			else if (flags & VOF_UTF8) {
-				for (; todo > 72; --todo) {
-					if ((line[pos+todo] & 0xc0) != 0x80)
-						/* next byte is a start sequence */
-						break;
-				}
+		vfold_puts(w, vp->key);
+		vprop_parse_meta(vp);
+		for (meta = vp->sub; meta; meta = meta->next) {
+			vfold_put(w, ";", 1);
+			vfold_puts(w, meta->key);
+			if (!meta->value)
+				continue;
+			if (strpbrk(meta->value, ":;")) {
+				vfold_put(w, "=\"", 2);
+				vfold_puts(w, meta->value);
+				vfold_put(w, "\"", 1);
+			} else {
+				vfold_put(w, "=", 1);
+				vfold_puts(w, meta->value);
 			}
-			if (pos)
-				fputc(' ', fp);
-			if (fwrite(line+pos, todo, 1, fp) < 0)
-				elog(LOG_ERR, errno, "fwrite");
-			fputs(newline, fp);
-			++nlines;
 		}
+		if (vp->lazy) {
+			/* stream the value from the source */
+			vfold_put(w, ":", 1);
+			if (vlazy_read(vp->lazy, vc->arena->src->fd,
+						vfold_append, w) < 0 && !w->s->err)
+				/* the value is incomplete */
+				w->s->err = errno;
+		} else if (vp->value) {
+			vfold_put(w, ":", 1);
+			vfold_puts(w, vp->value);
+		}
+		vfold_end(w);
 	}
 
 	/* write child objects */
 	for (child = vobject_first_child(vc); child; child = vobject_next_child(child))
-		nlines += vobject_write2(child, fp, flags);
+		vfold_vobject(w, child);
 
 	/* terminate vobject */
-	fprintf(fp, "END:%s%s", vc->type, newline);
-	++nlines;
-	return nlines;
+	vfold_puts(w, "END:");
+	vfold_puts(w, vc->type);
+	vfold_end(w);
+}
+
+int vobject_write_sink(const struct vobject *vc, struct vobject_sink *s,
+		int flags)
+{
+	struct vfold w = {
+		.s = s,
+		.flags = flags,
+		.width = (flags & VOF_WIDTH_MASK) / VOF_WIDTH(1) ?: VFOLD_WIDTH,
+		.linestart = s->fill,
+		.mark = VFOLD_NOMARK,
+	};
+
+	if (w.width < 16)
+		w.width = 16;
+
+	vfold_vobject(&w, vc);
+	if (s->fill >= VSINK_FLUSH)
+		vsink_write(s, s->fill);
+	return vsink_error(s) ?: w.nlines;
+}
+
+/* output vobjects, returns the number of ascii lines */
+int vobject_write2(const struct vobject *vc, FILE *fp, int flags)
+{
+	char buf[16384];
+	struct vobject_sink s = {
+		.fd = -1,
+		.fp = fp,
+		.buf = buf,
+		.size = sizeof(buf),
+		.fixed = 1,
+	};
+	int nlines;
+
+	nlines = vobject_write_sink(vc, &s, flags);
+	vsink_write(&s, s.fill);
+	return vsink_error(&s) ?: nlines;
 }
 
 int vobject_write(const struct vobject *vc, FILE *fp)
@@ -509,52 +2492,526 @@ int vobject_write(const struct vobject *vc, FILE *fp)
 	return vobject_write2(vc, fp, 0);
 }
 
-static struct vprop *vprop_dup(const struct vprop *src)
+size_t vobject_write_mem(const struct vobject *vc, char *out, size_t len,
+		int flags)
+{
+	char buf[16384];
+	struct vobject_sink s = {
+		.fd = -1,
+		.buf = buf,
+		.size = sizeof(buf),
+		.fixed = 1,
+		.count = 1,
+		.out = out,
+		.outlen = len,
+	};
+
+	vobject_write_sink(vc, &s, flags);
+	vsink_write(&s, s.fill);
+	return vsink_error(&s) ? (size_t)-1 : s.total;
+}
+
+size_t vobject_serialized_size(const struct vobject *vc, int flags)
+{
+	return vobject_write_mem(vc, NULL, 0, flags);
+}
+
+static struct vprop *vprop_dup(struct arena *arena, const struct vprop *src)
 {
 	struct vprop *dst;
 	struct vprop *vp;
-
-	/* duplicate memory */
-	dst = zalloc(sizeof(*dst) + strlen(src->key));
-	strcpy(dst->key, src->key);
-	/* set value & meta properly */
-	if (src->value)
-		dst->value = strdup(src->value);
+	struct arena *srcarena;
+
+	/* duplicate memory, set value & meta properly */
+	dst = mkvprop(arena, src->key, src->value, 1);
+	if (src->lazy) {
+		srcarena = vproptovobject(src)->arena;
+		if (!arena->src)
+			arena->src = vsource_get(srcarena->src);
+		if (arena->src == srcarena->src) {
+			dst->lazy = arena_alloc2(arena, sizeof(*dst->lazy),
+					sizeof(off_t));
+			*dst->lazy = *src->lazy;
+		} else
+			/* 1 source per arena */
+			dst->value = arena_strdup(arena, vprop_value(src->key));
+	}
+	if (src->rawmeta)
+		dst->rawmeta = arena_strdup(arena, src->rawmeta);
 	for (vp = src->sub; vp; vp = vp->next)
-		vprop_attach_vprop(vprop_dup(vp), dst);
+		vprop_attach_vprop(vprop_dup(arena, vp), dst);
 	return dst;
 }
 
-struct vobject *vobject_dup_root(const struct vobject *src)
+static struct vobject *vobject_dup_arena(const struct vobject *src,
+		struct arena *arena, int recursive)
 {
 	struct vobject *dst;
 	const struct vprop *prop;
 
-	dst = zalloc(sizeof(*dst));
-	dst->type = strdup(src->type);
+	dst = vobject_alloc(arena, src->type);
 
-	for (prop = src->props; prop; prop = prop->next) 
-		vprop_attach(vprop_dup(prop), dst);
+	for (prop = src->props; prop; prop = prop->next)
+		vprop_attach(vprop_dup(dst->arena, prop), dst);
+	if (recursive)
+		for (src = vobject_first_child(src); src; src = vobject_next_child(src))
+			vobject_attach(vobject_dup_arena(src, dst->arena, 1), dst);
 	return dst;
 }
 
+struct vobject *vobject_dup_root(const struct vobject *src)
+{
+	return vobject_dup_arena(src, NULL, 0);
+}
+
 struct vobject *vobject_dup(const struct vobject *src)
 {
-	struct vobject *dst, *sub;
+	return vobject_dup_arena(src, NULL, 1);
+}
+
+struct vobject *vobject_dup_into(const struct vobject *src,
+		struct vobject *parent)
+{
+	struct vobject *dst;
+
+	dst = vobject_dup_arena(src, parent->arena, 1);
+	vobject_attach(dst, parent);
+	return dst;
+}
+
+/* add the VTIMEZONE's of @origroot that @vo refers to, to @root */
+static void vobject_dup_timezones(const struct vobject *vo,
+		struct vobject *root, const struct vobject *origroot)
+{
+	const char *prop, *tzstr;
+	const struct vobject *tz;
+
+	for (prop = vobject_first_prop(vo); prop; prop = vprop_next(prop)) {
+		tzstr = vprop_meta_atom(prop, VA_TZID);
+		if (!tzstr)
+			continue;
 
-	dst = vobject_dup_root(src);
-	for (src = vobject_first_child(src); src; src = vobject_next_child(src)) {
-		sub = vobject_dup(src);
-		vobject_attach(sub, dst);
+		/* look for VTIMEZONE @tzstr */
+		for (tz = vobject_first_child(root); tz; tz = vobject_next_child(tz)) {
+			if (vobject_kind(tz) != VK_VTIMEZONE)
+				continue;
+			if (!strcmp(vobject_prop_atom(tz, VA_TZID) ?: "", tzstr))
+				/* VTIMEZONE already present */
+				break;
+		}
+		if (tz)
+			continue;
+		/* find the timezone in original vobject */
+		for (tz = vobject_first_child(origroot); tz; tz = vobject_next_child(tz)) {
+			if (vobject_kind(tz) != VK_VTIMEZONE)
+				continue;
+			if (!strcmp(vobject_prop_atom(tz, VA_TZID) ?: "", tzstr)) {
+				/* append timezone */
+				vobject_dup_into(tz, root);
+				break;
+			}
+		}
+		if (!tz)
+			elog(LOG_NOTICE, 0, "Timezone '%s' not found", tzstr);
 	}
+}
+
+struct vobject *vobject_dup_split(const struct vobject *root,
+		const struct vobject *child)
+{
+	struct vobject *dst;
+
+	dst = vobject_dup_root(root);
+	vobject_dup_timezones(child, dst, root);
+	vobject_dup_into(child, dst);
 	return dst;
 }
 
+/* construction */
+struct vobject *vobject_new(const char *type, struct vobject *parent)
+{
+	struct vobject *vo;
+
+	vo = vobject_alloc(parent ? parent->arena : NULL, type);
+	if (parent)
+		vobject_attach(vo, parent);
+	return vo;
+}
+
+const char *vobject_add_prop(struct vobject *vo, const char *key,
+		const char *value)
+{
+	struct vprop *vp;
+
+	vp = mkvprop(vo->arena, key, (char *)value, 1);
+	vprop_attach(vp, vo);
+	return vp->key;
+}
+
+const char *vprop_add_meta(const char *prop, const char *key,
+		const char *value)
+{
+	struct vprop *vp = usertovprop(prop), *meta;
+
+	/* keep the order of the parsed metadata */
+	vprop_parse_meta(vp);
+	meta = mkvprop(vproptovobject(vp)->arena, key, (char *)value, 1);
+	vprop_attach_vprop(meta, vp);
+	vobject_props_changed(vproptovobject(vp));
+	return meta->key;
+}
+
 /* VPROP manipulation */
 void vprop_remove(const char *prop)
 {
-	struct vprop *vprop = usertovprop(prop);
+	/* the memory is released with the arena */
+	vprop_detach(usertovprop(prop));
+}
+
+/*
+ * PARALLEL PARSING
+ *
+ * A quick scan over the BEGIN & END lines locates the toplevel vobjects.
+ * Big toplevel vobjects (like a calendar export) are split further
+ * into their children. Worker threads parse runs of these units in-place,
+ * and the calling thread assembles & delivers them in order.
+ */
+enum {
+	UNIT_OBJ, /* complete toplevel vobject */
+	UNIT_ROOT, /* toplevel vobject, without its children */
+	UNIT_CHILD, /* child of the preceding UNIT_ROOT */
+};
+
+struct vunit {
+	char *start, *end;
+	/* the lines before @start, and up to @end */
+	int line, endline;
+	int kind;
+	/* the vobject lacks its END */
+	int open;
+	struct vobject *vo;
+};
+
+struct vtask {
+	int first, last; /* unit range */
+	int done;
+};
+
+struct vparallel {
+	struct vunit *units;
+	int nunits, sunits;
+	struct vtask *tasks;
+	int ntasks, stasks;
+	/* task scheduling */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nexttask, consumed, window;
+
+	int (*filter)(struct vobject *vo, void *dat);
+	void *dat;
+	/* source of the raw text, @base is its offset 0 */
+	struct vsource *src;
+	char *base;
+};
+
+static struct vunit *vparallel_add(struct vparallel *vp, char *start, char *end,
+		int line, int kind)
+{
+	struct vunit *u;
+
+	if (vp->nunits >= vp->sunits) {
+		vp->sunits = vp->sunits*2 ?: 1024;
+		vp->units = realloc(vp->units, vp->sunits*sizeof(*vp->units));
+		if (!vp->units)
+			elog(LOG_ERR, errno, "realloc %u units", vp->sunits);
+	}
+	u = vp->units + vp->nunits++;
+	u->start = start;
+	u->end = end;
+	u->line = line;
+	u->kind = kind;
+	u->open = 0;
+	u->vo = NULL;
+	return u;
+}
+
+/*
+ * locate the toplevel vobjects, and the children of the big ones
+ * This follows the BEGIN/END logic of vparser_line()
+ */
+static void vparallel_scan(struct vparallel *vp, char *dat, char *end,
+		size_t bigsize)
+{
+	char *line, *eol, *next, *obj = NULL;
+	size_t len;
+	struct {
+		const char *type;
+		size_t len;
+	} *stack = NULL;
+	int depth = 0, sstack = 0, firstchild = 0, linenr = 0, objline = 0;
+
+	for (line = dat; line < end; line = next, ++linenr) {
+		eol = memchr(line, '\n', end - line);
+		next = eol ? eol+1 : end;
+		if (!strchr("BbEe", *line))
+			continue;
+		len = (eol ?: end) - line;
+		while (len && strchr("\r\n\v\f", line[len-1]))
+			--len;
+		if (len > 6 && !strncasecmp(line, "BEGIN:", 6)) {
+			if (depth >= sstack) {
+				sstack += 16;
+				stack = realloc(stack, sstack*sizeof(*stack));
+				if (!stack)
+					elog(LOG_ERR, errno, "realloc");
+			}
+			stack[depth].type = line+6;
+			stack[depth].len = len-6;
+			if (!depth) {
+				obj = line;
+				objline = linenr;
+				firstchild = vp->nunits;
+			} else if (depth == 1)
+				vparallel_add(vp, line, NULL, linenr, UNIT_CHILD);
+			++depth;
+		} else if (depth && len > 4 && !strncasecmp(line, "END:", 4) &&
+				len-4 == stack[depth-1].len &&
+				!strncasecmp(line+4, stack[depth-1].type, len-4)) {
+			--depth;
+			if (depth == 1) {
+				vp->units[vp->nunits-1].end = next;
+				vp->units[vp->nunits-1].endline = linenr+1;
+			} else if (!depth && (next - obj < bigsize ||
+						vp->nunits - firstchild < 2)) {
+				/* parse as a whole */
+				vp->nunits = firstchild;
+				vparallel_add(vp, obj, next, objline, UNIT_OBJ);
+			} else if (!depth) {
+				/* insert the root before its children */
+				vparallel_add(vp, NULL, NULL, 0, 0);
+				memmove(vp->units+firstchild+1, vp->units+firstchild,
+						(vp->nunits-firstchild-1)*sizeof(*vp->units));
+				vp->units[firstchild].start = obj;
+				vp->units[firstchild].end = next;
+				vp->units[firstchild].line = objline;
+				vp->units[firstchild].kind = UNIT_ROOT;
+				vp->units[firstchild].open = 0;
+				vp->units[firstchild].vo = NULL;
+			}
+		}
+	}
+	if (depth) {
+		/* incomplete last vobject */
+		vp->nunits = firstchild;
+		vparallel_add(vp, obj, end, objline, UNIT_OBJ)->open = 1;
+	}
+	if (stack)
+		free(stack);
+}
+
+/* group units in tasks of about @tasksize bytes */
+static void vparallel_mktasks(struct vparallel *vp, size_t tasksize)
+{
+	struct vtask *t = NULL;
+	int j;
+
+	for (j = 0; j < vp->nunits; ++j) {
+		if (vp->units[j].kind == UNIT_ROOT)
+			/* roots are parsed while assembling */
+			continue;
+		if (t && vp->units[j].end - vp->units[t->first].start < tasksize &&
+				vp->units[j-1].kind == vp->units[j].kind) {
+			t->last = j+1;
+			continue;
+		}
+		if (vp->ntasks >= vp->stasks) {
+			vp->stasks = vp->stasks*2 ?: 64;
+			vp->tasks = realloc(vp->tasks, vp->stasks*sizeof(*vp->tasks));
+			if (!vp->tasks)
+				elog(LOG_ERR, errno, "realloc %u tasks", vp->stasks);
+		}
+		t = vp->tasks + vp->ntasks++;
+		t->first = j;
+		t->last = j+1;
+		t->done = 0;
+	}
+}
+
+static void vparallel_dotask(struct vparallel *vp, struct vtask *t)
+{
+	struct vunit *u;
+	char *dat;
+	int linenr;
+
+	for (u = vp->units+t->first; u < vp->units+t->last; ++u) {
+		dat = u->start;
+		linenr = u->line;
+		u->vo = vobject_next_mem(&dat, u->end, &linenr);
+		if (u->vo && u->kind == UNIT_OBJ && vp->filter &&
+				!vp->filter(u->vo, vp->dat)) {
+			vobject_free(u->vo);
+			u->vo = NULL;
+		}
+	}
+}
+
+static void *vparallel_worker(void *dat)
+{
+	struct vparallel *vp = dat;
+	struct vtask *t;
+
+	pthread_mutex_lock(&vp->lock);
+	while (vp->nexttask < vp->ntasks) {
+		if (vp->nexttask >= vp->consumed + vp->window) {
+			/* don't run too far ahead */
+			pthread_cond_wait(&vp->cond, &vp->lock);
+			continue;
+		}
+		t = vp->tasks + vp->nexttask++;
+		pthread_mutex_unlock(&vp->lock);
+		vparallel_dotask(vp, t);
+		pthread_mutex_lock(&vp->lock);
+		t->done = 1;
+		pthread_cond_broadcast(&vp->cond);
+	}
+	pthread_mutex_unlock(&vp->lock);
+	return NULL;
+}
+
+/*
+ * keep the source text of a complete toplevel vobject, like
+ * vobject_reader_raw. This runs in the calling thread, that owns @vp->src.
+ */
+static void vparallel_raw(struct vparallel *vp, struct vobject *vo,
+		const struct vunit *u)
+{
+	if (!vp->src || u->open)
+		return;
+	vo->raw.off = u->start - vp->base;
+	vo->raw.len = u->end - u->start;
+	vo->dirty = 0;
+	if (!vo->arena->src)
+		vo->arena->src = vsource_get(vp->src);
+}
+
+/*
+ * parse a UNIT_ROOT, without its UNIT_CHILD's
+ * The workers may still parse the children in-place, so the root
+ * never touches their bytes: the pending property is added before each
+ * child, as its BEGIN line would do.
+ */
+static struct vobject *vparallel_root(struct vunit *u, struct vunit *uend)
+{
+	struct vparser p = { .inplace = 1, };
+	struct vobject *vo = NULL;
+	char *dat = u->start;
+	int linenr = u->line;
+	struct vunit *child;
+
+	for (child = u+1; child < uend && child->kind == UNIT_CHILD; ++child) {
+		vparse_lines(&p, &dat, child->start, &linenr);
+		vparser_flush(&p);
+		dat = child->end;
+		linenr = child->endline;
+	}
+	vo = vparse_mem(&p, &dat, u->end, &linenr);
+	vparser_free(&p);
+	return vo;
+}
+
+int vobject_parse_parallel(char *dat, char *end, int fd, int nthreads,
+		int (*filter)(struct vobject *vo, void *dat),
+		void (*cb)(struct vobject *vo, void *dat), void *cbdat)
+{
+	struct vparallel vp = {
+		.filter = filter,
+		.dat = cbdat,
+		.base = dat,
+		.window = 4*nthreads,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *threads;
+	struct vunit *u, *root = NULL;
+	struct vobject *vo;
+	struct vtask *t;
+	size_t tasksize;
+	int j, ret, nvobjects = 0;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	tasksize = (end - dat) / (nthreads*16);
+	if (tasksize < 256*1024)
+		tasksize = 256*1024;
+	vparallel_scan(&vp, dat, end, 4*tasksize);
+	vparallel_mktasks(&vp, tasksize);
+	if (fd >= 0) {
+		/* without a source, vobjects are serialized */
+		fd = dup(fd);
+		if (fd >= 0)
+			vp.src = vsource_new(fd);
+	}
+
+	threads = malloc(nthreads*sizeof(*threads));
+	if (!threads)
+		elog(LOG_ERR, errno, "malloc");
+	for (j = 0; j < nthreads; ++j) {
+		ret = pthread_create(threads+j, NULL, vparallel_worker, &vp);
+		if (ret)
+			elog(LOG_ERR, ret, "pthread_create");
+	}
+
+	/* assemble & deliver in order */
+	for (t = vp.tasks; t < vp.tasks+vp.ntasks; ++t) {
+		pthread_mutex_lock(&vp.lock);
+		while (!t->done)
+			pthread_cond_wait(&vp.cond, &vp.lock);
+		pthread_mutex_unlock(&vp.lock);
+
+		/* roots are not part of any task */
+		if (t->first && vp.units[t->first-1].kind == UNIT_ROOT) {
+			root = vp.units+t->first-1;
+			root->vo = vparallel_root(root, vp.units+vp.nunits);
+		}
+		for (u = vp.units+t->first; u < vp.units+t->last; ++u) {
+			vo = u->vo;
+			if (u->kind == UNIT_CHILD) {
+				if (vo && root->vo)
+					vobject_attach(vo, root->vo);
+				else if (vo)
+					vobject_free(vo);
+				if (u+1 < vp.units+vp.nunits &&
+						u[1].kind == UNIT_CHILD)
+					continue;
+				/* last child, root is complete */
+				vo = root->vo;
+				if (vo && filter && !filter(vo, cbdat)) {
+					vobject_free(vo);
+					vo = NULL;
+				}
+				if (vo)
+					vparallel_raw(&vp, vo, root);
+			} else if (vo)
+				vparallel_raw(&vp, vo, u);
+			if (vo) {
+				++nvobjects;
+				cb(vo, cbdat);
+			}
+		}
+		pthread_mutex_lock(&vp.lock);
+		++vp.consumed;
+		pthread_cond_broadcast(&vp.cond);
+		pthread_mutex_unlock(&vp.lock);
+	}
 
-	vprop_detach(vprop);
-	vprop_free(vprop);
+	for (j = 0; j < nthreads; ++j)
+		pthread_join(threads[j], NULL);
+	free(threads);
+	if (vp.src)
+		vsource_put(vp.src);
+	if (vp.units)
+		free(vp.units);
+	if (vp.tasks)
+		free(vp.tasks);
+	return nvobjects;
 }
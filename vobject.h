@@ -14,6 +14,21 @@ extern void *vobject_get_priv(const struct vobject *vc);
 
 /* access the type (VCALENDAR, VCARD, VEVENT, ... ) */
 extern const char *vobject_type(const struct vobject *vc);
+/* the type as enum, VK_OTHER for other types */
+enum vobject_kind {
+	VK_OTHER,
+	VK_VCALENDAR,
+	VK_VCARD,
+	VK_VEVENT,
+	VK_VTODO,
+	VK_VJOURNAL,
+	VK_VFREEBUSY,
+	VK_VTIMEZONE,
+	VK_VALARM,
+	VK_STANDARD,
+	VK_DAYLIGHT,
+};
+extern enum vobject_kind vobject_kind(const struct vobject *vc);
 /*
  * vprop walk functions
  * vobject_first_prop() retrieves the first property
@@ -35,6 +50,17 @@ extern const char *vprop_value(const char *str);
 /* vprop manipulation */
 extern void vprop_remove(const char *str);
 
+/*
+ * construction
+ * vobject_new() creates a child of @parent, or a toplevel vobject
+ * The properties are appended, and copied.
+ */
+extern struct vobject *vobject_new(const char *type, struct vobject *parent);
+extern const char *vobject_add_prop(struct vobject *vo, const char *key,
+		const char *value);
+extern const char *vprop_add_meta(const char *prop, const char *key,
+		const char *value);
+
 /* control hierarchy:
  *
  * vobject_first returns the first child vobject of a parent
@@ -64,25 +90,350 @@ extern const char *vobject_prop(const struct vobject *vc, const char *propname);
  */
 extern const char *vprop_meta(const char *prop, const char *metaname);
 
+/*
+ * atoms: interned property & metadata names, case insensitive
+ * The well-known names have fixed IDs, other names get an ID
+ * when they are first seen.
+ */
+enum vatom {
+	VA_UNKNOWN,
+	/* vcard */
+	VA_ADR,
+	VA_BDAY,
+	VA_CATEGORIES,
+	VA_EMAIL,
+	VA_FN,
+	VA_KEY,
+	VA_LABEL,
+	VA_LOGO,
+	VA_N,
+	VA_NICKNAME,
+	VA_NOTE,
+	VA_ORG,
+	VA_PHOTO,
+	VA_PRODID,
+	VA_REV,
+	VA_ROLE,
+	VA_SOUND,
+	VA_TEL,
+	VA_TITLE,
+	VA_UID,
+	VA_URL,
+	VA_VERSION,
+	/* icalendar */
+	VA_ATTACH,
+	VA_ATTENDEE,
+	VA_CALSCALE,
+	VA_CLASS,
+	VA_CREATED,
+	VA_DESCRIPTION,
+	VA_DTEND,
+	VA_DTSTAMP,
+	VA_DTSTART,
+	VA_DUE,
+	VA_DURATION,
+	VA_EXDATE,
+	VA_LAST_MODIFIED,
+	VA_LOCATION,
+	VA_METHOD,
+	VA_ORGANIZER,
+	VA_RDATE,
+	VA_RECURRENCE_ID,
+	VA_RRULE,
+	VA_SEQUENCE,
+	VA_STATUS,
+	VA_SUMMARY,
+	VA_TRANSP,
+	VA_TZID,
+	VA_TZNAME,
+	VA_TZOFFSETFROM,
+	VA_TZOFFSETTO,
+	/* metadata */
+	VA_ALTID,
+	VA_CHARSET,
+	VA_CN,
+	VA_ENCODING,
+	VA_LANGUAGE,
+	VA_MEDIATYPE,
+	VA_PARTSTAT,
+	VA_PREF,
+	VA_RSVP,
+	VA_TYPE,
+	VA_VALUE,
+	VA_NWELLKNOWN,
+};
+
+/* the atom of @name, created when unknown */
+extern int vobject_atom(const char *name);
+extern const char *vobject_atom_name(int atom);
+/* the atom of a property or metadata key */
+extern int vprop_atom(const char *prop);
+/* like vobject_prop & vprop_meta, but compare atoms */
+extern const char *vobject_prop_atom(const struct vobject *vc, int atom);
+extern const char *vprop_meta_atom(const char *prop, int atom);
+
+/*
+ * compact view of the props of a vobject, by index 0 .. n-1
+ * It is built on first use, as contiguous arrays of atoms, values
+ * and metadata ranges, so scans over many props do not chase the list.
+ * Changing the props of the vobject rebuilds it.
+ */
+extern int vobject_nprops(const struct vobject *vc);
+/* the prop at @idx, for the vprop functions */
+extern const char *vobject_prop_at(const struct vobject *vc, int idx);
+extern int vobject_atom_at(const struct vobject *vc, int idx);
+/* the value, and its length in *@plen when not NULL */
+extern const char *vobject_value_at(const struct vobject *vc, int idx,
+		size_t *plen);
+/* like vprop_meta_atom */
+extern const char *vobject_meta_at(const struct vobject *vc, int idx, int atom);
+/* the first prop with @atom, from @idx on, or -1 */
+extern int vobject_find_atom(const struct vobject *vc, int atom, int idx);
+
 /* FILE IO */
 
-/* read next vobject from file */
+/*
+ * reader: reads consecutive vobjects from 1 file,
+ * and keeps its buffers between vobjects
+ */
+struct vobject_reader;
+
+extern struct vobject_reader *vobject_reader_new(FILE *fp);
+/* read with large read() calls, bypassing stdio (blocksize 0: 1MB) */
+extern struct vobject_reader *vobject_reader_fd(int fd, size_t blocksize);
+extern void vobject_reader_free(struct vobject_reader *rd);
+extern struct vobject *vobject_reader_next(struct vobject_reader *rd);
+/* the line number of the last line read */
+extern int vobject_reader_linenr(const struct vobject_reader *rd);
+/*
+ * keep binary values beyond @threshold bytes out-of-line, for fd readers
+ * Binary are PHOTO, LOGO, SOUND, KEY, ATTACH, and base64 or VALUE=BINARY
+ * values. Only their range in the file is kept. vprop_value() reads them on demand,
+ * vobject_write2() copies them from the file, and the streaming parser
+ * reports them with a NULL value.
+ */
+extern int vobject_reader_lazy(struct vobject_reader *rd, size_t threshold);
+/* catches PHOTO and alike, not ordinary values */
+#define VOBJECT_LAZY_SIZE	4096
+/*
+ * remember the range of each toplevel vobject in the file, for fd readers
+ * vobject_write2() copies unmodified vobjects from the file, refolded
+ * for its flags, instead of serializing them.
+ */
+extern int vobject_reader_raw(struct vobject_reader *rd);
+
+/*
+ * push parser, for non-blocking input
+ * vobject_parser_feed() parses the data, and returns the number
+ * of completed vobjects waiting to be taken.
+ * Feed 0 bytes to signal EOF.
+ */
+struct vobject_parser;
+
+extern struct vobject_parser *vobject_parser_new(void);
+extern void vobject_parser_free(struct vobject_parser *vp);
+extern int vobject_parser_feed(struct vobject_parser *vp, const void *dat,
+		size_t len);
+extern struct vobject *vobject_parser_take(struct vobject_parser *vp);
+/* like vobject_reader_lazy, @fd holds the fed data, from offset 0 */
+extern int vobject_parser_lazy(struct vobject_parser *vp, int fd,
+		size_t threshold);
+
+/* read next vobject from file, without reader */
 extern struct vobject *vobject_next(FILE *fp, int *linenr);
 
-/* write vobjects */
+/*
+ * read next vobject from a writable memory buffer, in-place
+ * *pdat is advanced past the returned vobject.
+ * Values refer into the buffer, which is modified, and must
+ * remain valid while the vobjects are in use.
+ */
+extern struct vobject *vobject_next_mem(char **pdat, char *end, int *linenr);
+
+/*
+ * streaming parser, without building vobjects
+ * The callbacks get the strings of each element, which are only valid
+ * during the callback. Properties of nested vobjects are reported
+ * between their begin & end calls.
+ * When end() returns non-zero for a toplevel vobject, that vobject
+ * is built, passed to built(), and returned via @pvc.
+ * Returns 0 on EOF.
+ */
+struct vobject_sax {
+	void (*begin)(const char *type, void *dat);
+	void (*prop)(const char *key, const char *value, void *dat);
+	void (*meta)(const char *key, const char *metakey,
+			const char *metavalue, void *dat);
+	int (*end)(const char *type, void *dat);
+	void (*built)(struct vobject *vo, void *dat);
+};
+
+extern int vobject_reader_sax(struct vobject_reader *rd,
+		const struct vobject_sax *cb, void *dat, struct vobject **pvc);
+/* push parser: only queue the vobjects that @cb selects */
+extern void vobject_parser_sax(struct vobject_parser *vp,
+		const struct vobject_sax *cb, void *dat);
+extern int vobject_sax(FILE *fp, int *linenr, const struct vobject_sax *cb,
+		void *dat, struct vobject **pvc);
+
+/*
+ * read many files concurrently, with io_uring when available
+ * @cb gets each toplevel vobject, per file, in order of @files.
+ * Before the vobjects of a file, @cb is called with a NULL vobject.
+ * With @sax, only the vobjects that @sax selects are built.
+ * Values beyond @lazy bytes are kept out-of-line, see vobject_reader_lazy.
+ * Returns -1 with errno set, when the file after the last announced
+ * file failed.
+ */
+extern int vobject_read_files(char *const *files, int nfiles, size_t lazy,
+		const struct vobject_sax *sax,
+		void (*cb)(struct vobject *vo, int idx, void *dat), void *dat);
+
+/*
+ * map a file (private & writable) for vobject_next_mem
+ * Returns NULL for files that are not regular, which need a reader,
+ * and for empty files.
+ */
+extern char *vobject_mmap(int fd, size_t *plen);
+extern void vobject_munmap(char *dat, size_t len);
+
+/*
+ * parse a writable memory buffer, like vobject_next_mem, with @nthreads
+ * The optional @filter is called for each toplevel vobject, from any thread,
+ * and drops the vobject when it returns 0.
+ * @cb is called for each toplevel vobject, in order, from the calling thread,
+ * and takes ownership of the vobject.
+ * With @fd, the file that @dat maps from offset 0 (see vobject_mmap),
+ * unmodified vobjects keep their source text, like vobject_reader_raw.
+ * Pass -1 to only parse.
+ * Returns the number of vobjects passed to @cb
+ */
+extern int vobject_parse_parallel(char *dat, char *end, int fd, int nthreads,
+		int (*filter)(struct vobject *vo, void *dat),
+		void (*cb)(struct vobject *vo, void *dat), void *cbdat);
+
+/*
+ * binary cache of the parsed vobjects of @file
+ * The cache is (re)built when it does not match @file anymore.
+ * Returns NULL when the cache cannot be used.
+ */
+struct vobject_cache;
+extern struct vobject_cache *vobject_cache_open(const char *file,
+		const char *cachefile);
+extern void vobject_cache_close(struct vobject_cache *c);
+/*
+ * stream the cached vobjects through @cb, like vobject_reader_sax
+ * @result takes each selected toplevel vobject.
+ * Returns the number of vobjects passed to @result
+ */
+extern int vobject_cache_sax(struct vobject_cache *c,
+		const struct vobject_sax *cb, void *dat,
+		void (*result)(struct vobject *vo, void *dat));
+
+/*
+ * trigram index of the toplevel vobjects of @file
+ * @terms adds the searchable strings of each vobject with
+ * vobject_index_add, per field (0..255)
+ */
+struct vobject_index;
+struct vobject_index_terms;
+extern void vobject_index_add(struct vobject_index_terms *t, int field,
+		const char *str);
+extern int vobject_index_build(const char *file, const char *indexfile,
+		void (*terms)(const struct vobject *vo,
+			struct vobject_index_terms *t));
+/* returns NULL when the index does not match @file anymore */
+extern struct vobject_index *vobject_index_open(const char *file,
+		const char *indexfile);
+extern void vobject_index_close(struct vobject_index *idx);
+/*
+ * find the vobjects that may contain @str in @field, in file order
+ * *@pobjs must be freed. Returns -1 when @str is too short for the index.
+ */
+extern int vobject_index_lookup(struct vobject_index *idx, int field,
+		const char *str, int **pobjs);
+/* parse 1 vobject from the source */
+extern struct vobject *vobject_index_get(struct vobject_index *idx, int obj);
+
+/*
+ * index of the toplevel vobjects of @file by UID
+ * The children of a VCALENDAR are indexed by their own UID,
+ * vobject_index_get returns them like vobject_dup_split.
+ * Use vobject_index_get & vobject_index_close on it.
+ */
+extern int vobject_uidindex_build(const char *file, const char *indexfile);
+extern struct vobject_index *vobject_uidindex_open(const char *file,
+		const char *indexfile);
+/* find @uid, returns the number of vobjects, the first in *@pobj */
+extern int vobject_uidindex_lookup(struct vobject_index *idx, const char *uid,
+		int *pobj);
+extern const char *vobject_uidindex_type(struct vobject_index *idx, int obj);
+
+/*
+ * write vobjects, returns the number of lines,
+ * or -1 with errno when writing, or reading the source text
+ * of an unmodified or out-of-line part, failed
+ */
 extern int vobject_write(const struct vobject *vc, FILE *fp);
 extern int vobject_write2(const struct vobject *vc, FILE *fp, int flags);
 #define VOF_NOBREAK	0x01 /* allow lines >80 characters */
 #define VOF_UTF8	0x02 /* break lines on UTF8 start charachters */
 #define VOF_CRNL	0x04 /* \r\n for newlines */
+/* fold at @n octets (16..255) instead of 80, RFC 5545 & 6350 ask 75 */
+#define VOF_WIDTH(n)	(((n) & 0xff) << 16)
+#define VOF_WIDTH_MASK	VOF_WIDTH(0xff)
+
+/*
+ * output sink, with a buffer that collects whole vobjects
+ * vobject_sink_fd() & vobject_sink_file() write in large chunks.
+ * vobject_sink_mem() collects all output, see vobject_sink_data().
+ * vobject_sink_free() flushes, but does not close the fd or FILE.
+ * An I/O error sticks to the sink, vobject_sink_flush() and the writers
+ * return -1 from then on.
+ */
+struct vobject_sink;
+extern struct vobject_sink *vobject_sink_fd(int fd);
+extern struct vobject_sink *vobject_sink_file(FILE *fp);
+extern struct vobject_sink *vobject_sink_mem(void);
+extern const char *vobject_sink_data(const struct vobject_sink *s,
+		size_t *plen);
+extern int vobject_sink_flush(struct vobject_sink *s);
+extern void vobject_sink_free(struct vobject_sink *s);
+/* like vobject_write2 */
+extern int vobject_write_sink(const struct vobject *vc,
+		struct vobject_sink *s, int flags);
 
-/* free a vobject */
+/*
+ * serialize into a buffer of the caller, folding included
+ * vobject_write_mem() writes at most @len bytes, without terminating 0,
+ * and returns the length of the complete output, like snprintf.
+ * vobject_serialized_size() only returns that length.
+ * Both return (size_t)-1 when the source text cannot be read.
+ */
+extern size_t vobject_write_mem(const struct vobject *vc, char *buf,
+		size_t len, int flags);
+extern size_t vobject_serialized_size(const struct vobject *vc, int flags);
+
+/*
+ * free a vobject
+ * A vobject tree shares 1 memory arena, that is released
+ * when its last vobject is freed.
+ */
 extern void vobject_free(struct vobject *vc);
 
-/* duplication */
+/* duplication, into a new arena */
 extern struct vobject *vobject_dup(const struct vobject *vobj);
 /* duplicate, without recursion */
 extern struct vobject *vobject_dup_root(const struct vobject *vobj);
+/* duplicate into the arena of @parent, and attach to @parent */
+extern struct vobject *vobject_dup_into(const struct vobject *vobj,
+		struct vobject *parent);
+/*
+ * duplicate container @root with only @child,
+ * and the VTIMEZONE's that @child refers to
+ */
+extern struct vobject *vobject_dup_split(const struct vobject *root,
+		const struct vobject *child);
 
 /* create lowercase copy (cached) of a string */
 extern const char *lowercase(const char *str);
@@ -0,0 +1,615 @@
+/*
+ * Copyright 2014 Kurt Van Dijck <kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+/*
+ * Binary cache of the parsed vobjects of a file
+ *
+ * The cache starts with a header that identifies the source file,
+ * followed by 1 record per toplevel vobject.
+ * A record holds a property table, the offsets of its child records,
+ * the strings, and the child records. All offsets are relative
+ * to the start of the record, 0 means a NULL string.
+ * The cache uses the native byte order, it is not meant to be copied.
+ *
+ * The header also holds a checkpoint: the last toplevel vobject,
+ * and a hash of the block before it. When the source only grew,
+ * and that block did not change, only the last vobject and the appended
+ * data are parsed, and their records replace the last record.
+ * Updates write a new file and rename() it, under a lock on <cache>.lock.
+ */
+
+#define VCACHE_MAGIC	"VOCACHE3"
+/* hashed block before the checkpoint */
+#define VCACHE_BLK	4096
+
+struct vchdr {
+	char magic[8];
+	/* identification of the source */
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	/* end of the valid records */
+	uint64_t length;
+	/* checkpoint: start of the last vobject in the source, and its record */
+	uint64_t tail;
+	uint64_t tailrec;
+	uint64_t hash;
+	uint64_t flags;
+#define VCACHE_TAILOPEN	0x01 /* the last vobject lacks its END */
+};
+
+struct vcrec {
+	/* size, including children, aligned to 8 */
+	uint32_t size;
+	uint32_t type;
+	/* number of vcprop's, including metadata */
+	uint32_t nprops;
+	uint32_t nchildren;
+	/* vcprop[nprops], uint32_t child[nchildren], strings, children */
+};
+
+struct vcprop {
+	uint32_t key, value;
+	/* metadata vcprop's that follow */
+	uint32_t nmeta;
+};
+
+struct vobject_cache {
+	char *dat;
+	size_t len;
+};
+
+#define ALIGN8(x)	(((x) + 7) & ~7)
+
+/* growable buffer for writing records */
+struct vcbuf {
+	char *dat;
+	size_t len, size;
+};
+
+static size_t vcbuf_reserve(struct vcbuf *b, size_t len)
+{
+	size_t pos = b->len;
+
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->dat = realloc(b->dat, b->size);
+		if (!b->dat)
+			elog(LOG_ERR, errno, "realloc %zu", b->size);
+	}
+	memset(b->dat + pos, 0, len);
+	b->len += len;
+	return pos;
+}
+
+/* add a string, return its offset relative to @rec */
+static uint32_t vcbuf_str(struct vcbuf *b, size_t rec, const char *str)
+{
+	size_t pos;
+
+	if (!str)
+		return 0;
+	pos = vcbuf_reserve(b, strlen(str)+1);
+	strcpy(b->dat + pos, str);
+	return pos - rec;
+}
+
+#define vcbuf_at(b, type, pos)	((type *)((b)->dat + (pos)))
+
+/* serialize @vo as record */
+static void vcache_put(struct vcbuf *b, const struct vobject *vo)
+{
+	size_t rec, props, children;
+	const char *prop, *meta;
+	const struct vobject *child;
+	int nprops = 0, nchildren = 0, j, nmeta;
+	uint32_t key, value;
+
+	for (prop = vobject_first_prop(vo); prop; prop = vprop_next(prop)) {
+		++nprops;
+		for (meta = vprop_first_meta(prop); meta; meta = vprop_next(meta))
+			++nprops;
+	}
+	for (child = vobject_first_child(vo); child; child = vobject_next_child(child))
+		++nchildren;
+
+	rec = vcbuf_reserve(b, sizeof(struct vcrec));
+	props = vcbuf_reserve(b, nprops*sizeof(struct vcprop));
+	children = vcbuf_reserve(b, nchildren*sizeof(uint32_t));
+	vcbuf_at(b, struct vcrec, rec)->nprops = nprops;
+	vcbuf_at(b, struct vcrec, rec)->nchildren = nchildren;
+	/* vcbuf_str may move the buffer */
+	key = vcbuf_str(b, rec, vobject_type(vo));
+	vcbuf_at(b, struct vcrec, rec)->type = key;
+
+	j = 0;
+	for (prop = vobject_first_prop(vo); prop; prop = vprop_next(prop)) {
+		size_t pp = props + j++*sizeof(struct vcprop);
+
+		key = vcbuf_str(b, rec, prop);
+		value = vcbuf_str(b, rec, vprop_value(prop));
+		vcbuf_at(b, struct vcprop, pp)->key = key;
+		vcbuf_at(b, struct vcprop, pp)->value = value;
+		nmeta = 0;
+		for (meta = vprop_first_meta(prop); meta; meta = vprop_next(meta)) {
+			size_t mp = props + j++*sizeof(struct vcprop);
+
+			key = vcbuf_str(b, rec, meta);
+			value = vcbuf_str(b, rec, vprop_value(meta));
+			vcbuf_at(b, struct vcprop, mp)->key = key;
+			vcbuf_at(b, struct vcprop, mp)->value = value;
+			++nmeta;
+		}
+		vcbuf_at(b, struct vcprop, pp)->nmeta = nmeta;
+	}
+	vcbuf_reserve(b, ALIGN8(b->len) - b->len);
+
+	j = 0;
+	for (child = vobject_first_child(vo); child; child = vobject_next_child(child)) {
+		vcbuf_at(b, uint32_t, children)[j++] = b->len - rec;
+		vcache_put(b, child);
+	}
+	vcbuf_at(b, struct vcrec, rec)->size = b->len - rec;
+}
+
+/* record access */
+#define vcrec_str(rec, off)	((off) ? (const char *)(rec) + (off) : NULL)
+#define vcrec_props(rec)	((const struct vcprop *)((rec) + 1))
+#define vcrec_children(rec)	((const uint32_t *)(vcrec_props(rec) + (rec)->nprops))
+#define vcrec_child(rec, j)	\
+	((const struct vcrec *)((const char *)(rec) + vcrec_children(rec)[j]))
+
+/* test a string offset of a record of @size bytes, beyond its tables */
+static int vcache_check_str(const struct vcrec *rec, uint64_t tables,
+		uint64_t size, uint32_t off)
+{
+	if (!off)
+		return 0;
+	if (off < tables || off >= size ||
+			!memchr((const char *)rec + off, 0, size - off))
+		return -1;
+	return 0;
+}
+
+/*
+ * test a record, and its children, in @size bytes
+ * Every offset must stay inside the record, before it is used.
+ */
+static int vcache_check_rec(const struct vcrec *rec, uint64_t size)
+{
+	const struct vcprop *p;
+	uint64_t tables;
+	uint32_t off;
+	int j;
+
+	if (size < sizeof(*rec) || rec->size < sizeof(*rec) ||
+			rec->size > size || (rec->size & 7))
+		return -1;
+	size = rec->size;
+	tables = sizeof(*rec) + (uint64_t)rec->nprops*sizeof(struct vcprop) +
+		(uint64_t)rec->nchildren*sizeof(uint32_t);
+	if (tables > size || !rec->type ||
+			vcache_check_str(rec, tables, size, rec->type) < 0)
+		return -1;
+	p = vcrec_props(rec);
+	for (j = 0; j < rec->nprops; ++j) {
+		if (!p[j].key ||
+				vcache_check_str(rec, tables, size, p[j].key) < 0 ||
+				vcache_check_str(rec, tables, size, p[j].value) < 0)
+			return -1;
+	}
+	for (j = 0; j < rec->nprops; j += 1 + p[j].nmeta) {
+		if (p[j].nmeta >= rec->nprops - j)
+			return -1;
+	}
+	for (j = 0; j < rec->nchildren; ++j) {
+		off = vcrec_children(rec)[j];
+		if (off < tables || (off & 7) ||
+				vcache_check_rec(vcrec_child(rec, j), size - off) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* test the records from @pos to @end, @tailrec must start one of them */
+static int vcache_check(const char *pos, const char *end, const char *tailrec)
+{
+	const struct vcrec *rec;
+	int tailok = tailrec == end;
+
+	for (; pos < end; pos += rec->size) {
+		rec = (const void *)pos;
+		if (vcache_check_rec(rec, end - pos) < 0)
+			return -1;
+		if (pos == tailrec)
+			tailok = 1;
+	}
+	return tailok ? 0 : -1;
+}
+
+/*
+ * FNV-1a of the block before the checkpoint
+ * This reads the file, since parsing modifies the mapped source.
+ */
+static uint64_t vcache_hash(int fd, size_t tail)
+{
+	unsigned char blk[VCACHE_BLK];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t len = (tail < VCACHE_BLK) ? tail : VCACHE_BLK;
+	int j;
+
+	if (pread(fd, blk, len, tail - len) != len)
+		return 0;
+	for (j = 0; j < len; ++j)
+		hash = (hash ^ blk[j]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/* test if the file ends with END:@type */
+static int vcache_ended(int fd, size_t len, const char *type)
+{
+	char buf[256], *line;
+	size_t n = (len < sizeof(buf)-1) ? len : sizeof(buf)-1;
+
+	if (pread(fd, buf, n, len - n) != n)
+		return 0;
+	for (; n && strchr("\r\n\v\f \t", buf[n-1]); --n);
+	buf[n] = 0;
+	line = strrchr(buf, '\n');
+	line = line ? line+1 : buf;
+	return !strncasecmp(line, "END:", 4) && !strcasecmp(line+4, type);
+}
+
+/*
+ * parse the source from the checkpoint in @hdr,
+ * and serialize the records into @b, to be stored at hdr->tailrec
+ */
+static void vcache_parse(struct vchdr *hdr, int fd, char *dat, size_t len,
+		const struct stat *st, struct vcbuf *b)
+{
+	struct vobject *vo;
+	char *pos, *start;
+	uint64_t recpos = hdr->tailrec;
+
+	for (pos = start = dat + hdr->tail;
+			(vo = vobject_next_mem(&pos, dat+len, NULL)) != NULL;
+			start = pos) {
+		hdr->tail = start - dat;
+		hdr->tailrec = recpos + b->len;
+		hdr->flags &= ~VCACHE_TAILOPEN;
+		if (pos >= dat+len && !vcache_ended(fd, len, vobject_type(vo)))
+			hdr->flags |= VCACHE_TAILOPEN;
+		vcache_put(b, vo);
+		vobject_free(vo);
+	}
+	hdr->length = recpos + b->len;
+	hdr->hash = vcache_hash(fd, hdr->tail);
+	hdr->size = st->st_size;
+	hdr->ino = st->st_ino;
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * write a new cache for @cachefile: @hdr, @nkeep bytes of records
+ * of the old cache at @keep, and the records in @b
+ * The new cache replaces the old one with rename(), so readers that
+ * have the old one mapped never see a partial update.
+ */
+static int vcache_write(const char *cachefile, const struct vchdr *hdr,
+		const void *keep, size_t nkeep, const struct vcbuf *b)
+{
+	char *tmpfile;
+	int out, written, ret = -1;
+	FILE *fp;
+
+	if (asprintf(&tmpfile, "%s.XXXXXX", cachefile) < 0)
+		return -1;
+	out = mkstemp(tmpfile);
+	if (out < 0)
+		goto fail_mkstemp;
+	fp = fdopen(out, "w");
+	if (!fp) {
+		close(out);
+		goto fail_fdopen;
+	}
+	written = fwrite(hdr, sizeof(*hdr), 1, fp) == 1 &&
+		(!nkeep || fwrite(keep, nkeep, 1, fp) == 1) &&
+		(!b->len || fwrite(b->dat, b->len, 1, fp) == 1);
+	if (fclose(fp) == 0 && written && rename(tmpfile, cachefile) == 0)
+		ret = 0;
+fail_fdopen:
+	if (ret < 0)
+		unlink(tmpfile);
+fail_mkstemp:
+	free(tmpfile);
+	return ret;
+}
+
+/* (re)build the cache of @file */
+static int vcache_build(const char *file, const char *cachefile)
+{
+	struct vchdr hdr = {
+		.magic = VCACHE_MAGIC,
+		.length = sizeof(hdr),
+		.tailrec = sizeof(hdr),
+	};
+	struct vcbuf b = {};
+	struct stat st;
+	char *dat;
+	size_t len;
+	int fd, ret = -1;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto fail_stat;
+	dat = vobject_mmap(fd, &len);
+	if (!dat && st.st_size)
+		goto fail_stat;
+
+	vcache_parse(&hdr, fd, dat, len, &st, &b);
+	ret = vcache_write(cachefile, &hdr, NULL, 0, &b);
+	if (b.dat)
+		free(b.dat);
+	vobject_munmap(dat, len);
+fail_stat:
+	close(fd);
+	return ret;
+}
+
+/*
+ * bring the cache of @file up to date, when data was only appended
+ * Returns -1 when the cache must be rebuilt
+ */
+static int vcache_append(const char *file, const char *cachefile)
+{
+	struct vchdr hdr;
+	struct vcbuf b = {};
+	struct stat st, cst;
+	char *dat, *old;
+	size_t len, keep;
+	int fd, ret = -1;
+
+	fd = open(cachefile, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &cst) < 0 || cst.st_size < sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+	old = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (old == MAP_FAILED)
+		return -1;
+	memcpy(&hdr, old, sizeof(hdr));
+	if (memcmp(hdr.magic, VCACHE_MAGIC, sizeof(hdr.magic)) ||
+			hdr.length > cst.st_size || hdr.tailrec > hdr.length ||
+			hdr.tailrec < sizeof(hdr) ||
+			vcache_check(old + sizeof(hdr), old + hdr.tailrec,
+				old + hdr.tailrec) < 0)
+		goto fail_hdr;
+	/* the records before the checkpoint remain */
+	keep = hdr.tailrec - sizeof(hdr);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		goto fail_hdr;
+	if (fstat(fd, &st) < 0 || st.st_ino != hdr.ino ||
+			st.st_size < hdr.size || hdr.tail > hdr.size)
+		goto fail_stat;
+	dat = vobject_mmap(fd, &len);
+	if (!dat)
+		goto fail_stat;
+	if (vcache_hash(fd, hdr.tail) != hdr.hash)
+		goto fail_hash;
+
+	vcache_parse(&hdr, fd, dat, len, &st, &b);
+	ret = vcache_write(cachefile, &hdr, old + sizeof(hdr), keep, &b);
+	if (b.dat)
+		free(b.dat);
+fail_hash:
+	vobject_munmap(dat, len);
+fail_stat:
+	close(fd);
+fail_hdr:
+	munmap(old, cst.st_size);
+	return ret;
+}
+
+/* serialize the updates of @cachefile, which replace the file itself */
+static int vcache_lock(const char *cachefile)
+{
+	char *lockfile;
+	int fd;
+
+	if (asprintf(&lockfile, "%s.lock", cachefile) < 0)
+		return -1;
+	fd = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(lockfile);
+	if (fd >= 0 && flock(fd, LOCK_EX) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* map the cache, when it matches @st */
+static struct vobject_cache *vcache_map(const char *cachefile,
+		const struct stat *st)
+{
+	struct vobject_cache *c;
+	const struct vchdr *hdr;
+	struct stat cst;
+	int fd;
+
+	fd = open(cachefile, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &cst) < 0 || cst.st_size < sizeof(*hdr))
+		goto fail;
+	c = malloc(sizeof(*c));
+	if (!c)
+		elog(LOG_ERR, errno, "malloc");
+	c->len = cst.st_size;
+	c->dat = mmap(NULL, c->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (c->dat == MAP_FAILED)
+		goto fail_map;
+	close(fd);
+
+	hdr = (const void *)c->dat;
+	if (memcmp(hdr->magic, VCACHE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->size != st->st_size || hdr->ino != st->st_ino ||
+			hdr->mtime_sec != st->st_mtim.tv_sec ||
+			hdr->mtime_nsec != st->st_mtim.tv_nsec ||
+			hdr->length > c->len || hdr->length < sizeof(*hdr) ||
+			hdr->tailrec > hdr->length ||
+			/* a corrupt cache is rebuilt */
+			vcache_check(c->dat + sizeof(*hdr), c->dat + hdr->length,
+				c->dat + hdr->tailrec) < 0) {
+		vobject_cache_close(c);
+		return NULL;
+	}
+	return c;
+
+fail_map:
+	free(c);
+fail:
+	close(fd);
+	return NULL;
+}
+
+struct vobject_cache *vobject_cache_open(const char *file,
+		const char *cachefile)
+{
+	struct vobject_cache *c;
+	struct stat st;
+	int lock;
+
+	if (stat(file, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+	c = vcache_map(cachefile, &st);
+	if (c)
+		return c;
+	lock = vcache_lock(cachefile);
+	if (lock < 0)
+		return NULL;
+	/* another process may have updated it meanwhile */
+	c = vcache_map(cachefile, &st);
+	if (!c && (vcache_append(file, cachefile) == 0 ||
+			vcache_build(file, cachefile) == 0) &&
+			/* the source may have changed again meanwhile */
+			stat(file, &st) == 0)
+		c = vcache_map(cachefile, &st);
+	close(lock);
+	return c;
+}
+
+void vobject_cache_close(struct vobject_cache *c)
+{
+	munmap(c->dat, c->len);
+	free(c);
+}
+
+/* build a vobject from a record */
+static struct vobject *vcache_load(const struct vcrec *rec,
+		struct vobject *parent)
+{
+	struct vobject *vo;
+	const struct vcprop *p = vcrec_props(rec);
+	const char *prop;
+	int j, k;
+
+	vo = vobject_new(vcrec_str(rec, rec->type), parent);
+	for (j = 0; j < rec->nprops; j += 1 + p[j].nmeta) {
+		prop = vobject_add_prop(vo, vcrec_str(rec, p[j].key),
+				vcrec_str(rec, p[j].value));
+		for (k = 1; k <= p[j].nmeta; ++k)
+			vprop_add_meta(prop, vcrec_str(rec, p[j+k].key),
+					vcrec_str(rec, p[j+k].value));
+	}
+	for (j = 0; j < rec->nchildren; ++j)
+		vcache_load(vcrec_child(rec, j), vo);
+	return vo;
+}
+
+/* stream a record through the callbacks */
+static int vcache_sax_rec(const struct vcrec *rec,
+		const struct vobject_sax *cb, void *dat)
+{
+	const struct vcprop *p = vcrec_props(rec);
+	const char *key;
+	int j, k;
+
+	if (cb->begin)
+		cb->begin(vcrec_str(rec, rec->type), dat);
+	for (j = 0; j < rec->nprops; j += 1 + p[j].nmeta) {
+		key = vcrec_str(rec, p[j].key);
+		if (cb->prop)
+			cb->prop(key, vcrec_str(rec, p[j].value), dat);
+		for (k = 1; cb->meta && k <= p[j].nmeta; ++k)
+			cb->meta(key, vcrec_str(rec, p[j+k].key),
+					vcrec_str(rec, p[j+k].value), dat);
+	}
+	for (j = 0; j < rec->nchildren; ++j)
+		vcache_sax_rec(vcrec_child(rec, j), cb, dat);
+	return cb->end ? cb->end(vcrec_str(rec, rec->type), dat) : 0;
+}
+
+int vobject_cache_sax(struct vobject_cache *c, const struct vobject_sax *cb,
+		void *dat, void (*result)(struct vobject *vo, void *dat))
+{
+	const struct vchdr *hdr = (const void *)c->dat;
+	const struct vcrec *rec;
+	const char *pos, *end = c->dat + hdr->length;
+	struct vobject *vo;
+	int nresults = 0;
+
+	for (pos = c->dat + sizeof(struct vchdr); pos + sizeof(*rec) <= end;
+			pos += rec->size) {
+		rec = (const void *)pos;
+		/* vcache_map() checked the records */
+		if (!vcache_sax_rec(rec, cb, dat))
+			continue;
+		/* like the stream parsers, never select an unterminated vobject */
+		if ((hdr->flags & VCACHE_TAILOPEN) && pos == c->dat + hdr->tailrec)
+			continue;
+		vo = vcache_load(rec, NULL);
+		if (cb->built)
+			cb->built(vo, dat);
+		++nresults;
+		result(vo, dat);
+	}
+	return nresults;
+}
@@ -0,0 +1,463 @@
+/*
+ * Copyright 2014 Kurt Van Dijck <kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+/*
+ * Read many files concurrently
+ *
+ * Opens and reads of the next files are submitted at once with io_uring.
+ * Without io_uring, the next files are opened and readahead is started
+ * for them, while reading them in order.
+ * The data is fed to a push parser per file, in order of the files.
+ * At most VFILES_OPEN files are open, and at most VFILE_CHUNKS chunks
+ * of a file wait to be parsed.
+ */
+
+#define CHUNKSZ	(256*1024)
+/* files open ahead of the parser */
+#define VFILES_OPEN	16
+/* chunks read ahead per file */
+#define VFILE_CHUNKS	4
+
+struct vchunk {
+	struct vchunk *next;
+	size_t len;
+	char dat[CHUNKSZ];
+};
+
+struct vfile {
+	int fd;
+	int err;
+	int done;
+	int wantread;
+	off_t off;
+	/* completed reads, waiting to be parsed */
+	struct vchunk *chunks, **tail;
+	int nchunks;
+	/* read in progress */
+	struct vchunk *rdchunk;
+};
+
+/* deliver the vobjects from a parser */
+static void vfiles_deliver(struct vobject_parser *vp, int idx,
+		void (*cb)(struct vobject *vo, int idx, void *dat), void *dat)
+{
+	struct vobject *vo;
+
+	while ((vo = vobject_parser_take(vp)) != NULL)
+		cb(vo, idx, dat);
+}
+
+/* portable version */
+static int vfiles_read_sync(char *const *files, int nfiles, size_t lazy,
+		const struct vobject_sax *sax,
+		void (*cb)(struct vobject *vo, int idx, void *dat), void *dat)
+{
+	struct vobject_reader *rd;
+	struct vobject *vo;
+	int *fds, j, nextopen = 0, err = 0;
+
+	fds = malloc(nfiles*sizeof(*fds));
+	if (!fds)
+		elog(LOG_ERR, errno, "malloc");
+
+	for (j = 0; j < nfiles; ++j) {
+		/* start readahead on the next files */
+		for (; nextopen < nfiles && nextopen < j + VFILES_OPEN; ++nextopen) {
+			fds[nextopen] = open(files[nextopen], O_RDONLY);
+			if (fds[nextopen] >= 0)
+				posix_fadvise(fds[nextopen], 0, 0, POSIX_FADV_WILLNEED);
+		}
+		if (fds[j] < 0) {
+			/* retry, to get a proper errno */
+			fds[j] = open(files[j], O_RDONLY);
+			if (fds[j] < 0)
+				break;
+		}
+		cb(NULL, j, dat);
+		rd = vobject_reader_fd(fds[j], 0);
+		if (lazy)
+			vobject_reader_lazy(rd, lazy);
+		if (sax) {
+			while (vobject_reader_sax(rd, sax, dat, &vo))
+				if (vo)
+					cb(vo, j, dat);
+		} else {
+			while ((vo = vobject_reader_next(rd)) != NULL)
+				cb(vo, j, dat);
+		}
+		vobject_reader_free(rd);
+		close(fds[j]);
+	}
+	if (j < nfiles) {
+		err = errno;
+		for (; j < nextopen; ++j)
+			if (fds[j] >= 0)
+				close(fds[j]);
+	}
+	free(fds);
+	errno = err;
+	return err ? -1 : 0;
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+
+/* minimal io_uring, straight on the syscalls */
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqptr, *cqptr;
+	size_t sqlen, cqlen, sqeslen;
+	/* queued, not submitted */
+	unsigned queued;
+	/* submitted, not completed */
+	unsigned inflight;
+	unsigned entries;
+};
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+	u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqlen > u->sqlen)
+			u->sqlen = u->cqlen;
+		u->cqlen = 0;
+	}
+	u->sqptr = mmap(NULL, u->sqlen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqptr == MAP_FAILED)
+		goto fail_sq;
+	if (u->cqlen) {
+		u->cqptr = mmap(NULL, u->cqlen, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqptr == MAP_FAILED)
+			goto fail_cq;
+	} else
+		u->cqptr = u->sqptr;
+	u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_sqes;
+
+	u->sqhead = u->sqptr + p.sq_off.head;
+	u->sqtail = u->sqptr + p.sq_off.tail;
+	u->sqmask = u->sqptr + p.sq_off.ring_mask;
+	u->sqarray = u->sqptr + p.sq_off.array;
+	u->cqhead = u->cqptr + p.cq_off.head;
+	u->cqtail = u->cqptr + p.cq_off.tail;
+	u->cqmask = u->cqptr + p.cq_off.ring_mask;
+	u->cqes = u->cqptr + p.cq_off.cqes;
+	return 0;
+
+fail_sqes:
+	if (u->cqlen)
+		munmap(u->cqptr, u->cqlen);
+fail_cq:
+	munmap(u->sqptr, u->sqlen);
+fail_sq:
+	close(u->fd);
+	return -1;
+}
+
+static void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqeslen);
+	if (u->cqlen)
+		munmap(u->cqptr, u->cqlen);
+	munmap(u->sqptr, u->sqlen);
+	close(u->fd);
+}
+
+/* get a free sqe, limited so that completions never overflow */
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sqtail;
+
+	if (u->queued + u->inflight >= u->entries)
+		return NULL;
+	sqe = &u->sqes[tail & *u->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void uring_queue(struct uring *u)
+{
+	unsigned tail = *u->sqtail;
+
+	u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+	__atomic_store_n(u->sqtail, tail+1, __ATOMIC_RELEASE);
+	++u->queued;
+}
+
+static int uring_submit_wait(struct uring *u)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, u->fd, u->queued, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0)
+		return ret;
+	u->inflight += ret;
+	u->queued -= ret;
+	return 0;
+}
+
+static struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+	unsigned head = *u->cqhead;
+
+	if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cqmask];
+}
+
+static void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cqhead, *u->cqhead+1, __ATOMIC_RELEASE);
+	--u->inflight;
+}
+
+/* user_data encoding */
+#define OP_OPEN	0
+#define OP_READ	1
+#define mkudata(idx, op)	(((__u64)(idx) << 1) | (op))
+
+static int vfile_queue_read(struct uring *u, struct vfile *f, int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(u);
+	if (!sqe)
+		return -1;
+	if (!f->rdchunk) {
+		f->rdchunk = malloc(sizeof(*f->rdchunk));
+		if (!f->rdchunk)
+			elog(LOG_ERR, errno, "malloc");
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->off = f->off;
+	sqe->addr = (unsigned long)f->rdchunk->dat;
+	sqe->len = sizeof(f->rdchunk->dat);
+	sqe->user_data = mkudata(idx, OP_READ);
+	uring_queue(u);
+	f->wantread = 0;
+	return 0;
+}
+
+static void vfile_complete(struct vfile *f, int op, int res, const char *file)
+{
+	struct vchunk *c;
+
+	if (op == OP_OPEN) {
+		if (res < 0) {
+			/* retry synchronous, old kernels lack OPENAT */
+			res = open(file, O_RDONLY);
+			if (res < 0)
+				res = -errno;
+		}
+		if (res < 0)
+			f->err = -res;
+		else {
+			f->fd = res;
+			f->wantread = 1;
+		}
+		return;
+	}
+	if (res == -EINVAL || res == -EOPNOTSUPP) {
+		/* retry synchronous, old kernels lack READ */
+		res = pread(f->fd, f->rdchunk->dat, sizeof(f->rdchunk->dat),
+				f->off);
+		if (res < 0)
+			res = -errno;
+	}
+	if (res < 0) {
+		f->err = -res;
+	} else if (!res) {
+		f->done = 1;
+	} else {
+		c = f->rdchunk;
+		f->rdchunk = NULL;
+		c->len = res;
+		c->next = NULL;
+		*f->tail = c;
+		f->tail = &c->next;
+		++f->nchunks;
+		f->off += res;
+		f->wantread = 1;
+	}
+}
+
+int vobject_read_files(char *const *files, int nfiles, size_t lazy,
+		const struct vobject_sax *sax,
+		void (*cb)(struct vobject *vo, int idx, void *dat), void *dat)
+{
+	struct uring u;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct vfile *vf, *f;
+	struct vchunk *c;
+	struct vobject_parser *vp = NULL;
+	int j, cur, nextopen, err = 0;
+
+	if (!nfiles)
+		return 0;
+	if (uring_init(&u, 64) < 0)
+		return vfiles_read_sync(files, nfiles, lazy, sax, cb, dat);
+
+	vf = calloc(nfiles, sizeof(*vf));
+	if (!vf)
+		elog(LOG_ERR, errno, "calloc");
+	for (j = 0; j < nfiles; ++j) {
+		vf[j].fd = -1;
+		vf[j].tail = &vf[j].chunks;
+	}
+
+	for (cur = nextopen = 0; cur < nfiles; ) {
+		/* parse what is available, in order */
+		for (f = vf+cur; cur < nfiles; ++cur, ++f) {
+			if (f->err) {
+				err = f->err;
+				goto done;
+			}
+			if (f->fd < 0)
+				break;
+			if (!vp) {
+				vp = vobject_parser_new();
+				if (lazy)
+					vobject_parser_lazy(vp, f->fd, lazy);
+				if (sax)
+					vobject_parser_sax(vp, sax, dat);
+				cb(NULL, cur, dat);
+			}
+			while (f->chunks) {
+				c = f->chunks;
+				f->chunks = c->next;
+				--f->nchunks;
+				vobject_parser_feed(vp, c->dat, c->len);
+				vfiles_deliver(vp, cur, cb, dat);
+				free(c);
+			}
+			f->tail = &f->chunks;
+			if (!f->done)
+				break;
+			/* EOF */
+			vobject_parser_feed(vp, NULL, 0);
+			vfiles_deliver(vp, cur, cb, dat);
+			vobject_parser_free(vp);
+			vp = NULL;
+			close(f->fd);
+			f->fd = -1;
+		}
+		if (cur >= nfiles)
+			break;
+
+		/* submit reads, then opens */
+		for (j = cur; j < nextopen; ++j)
+			if (vf[j].wantread && !vf[j].err && !vf[j].done &&
+					vf[j].nchunks < VFILE_CHUNKS &&
+					vfile_queue_read(&u, vf+j, j) < 0)
+				break;
+		for (; nextopen < nfiles && nextopen < cur + VFILES_OPEN; ++nextopen) {
+			sqe = uring_get_sqe(&u);
+			if (!sqe)
+				break;
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)files[nextopen];
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data = mkudata(nextopen, OP_OPEN);
+			uring_queue(&u);
+		}
+		if (uring_submit_wait(&u) < 0) {
+			err = errno;
+			elog(LOG_INFO, errno, "io_uring_enter");
+			goto done;
+		}
+		while ((cqe = uring_cqe(&u)) != NULL) {
+			j = cqe->user_data >> 1;
+			vfile_complete(vf+j, cqe->user_data & 1, cqe->res, files[j]);
+			uring_cqe_seen(&u);
+		}
+	}
+done:
+	if (vp)
+		vobject_parser_free(vp);
+	/* wait for outstanding I/O before releasing its buffers */
+	while (u.inflight) {
+		if (syscall(__NR_io_uring_enter, u.fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			break;
+		while ((cqe = uring_cqe(&u)) != NULL) {
+			j = cqe->user_data >> 1;
+			if ((cqe->user_data & 1) == OP_OPEN && cqe->res >= 0)
+				vf[j].fd = cqe->res;
+			uring_cqe_seen(&u);
+		}
+	}
+	uring_exit(&u);
+	for (j = 0; j < nfiles; ++j) {
+		while (vf[j].chunks) {
+			c = vf[j].chunks;
+			vf[j].chunks = c->next;
+			free(c);
+		}
+		if (vf[j].rdchunk)
+			free(vf[j].rdchunk);
+		if (vf[j].fd >= 0)
+			close(vf[j].fd);
+	}
+	free(vf);
+	errno = err;
+	return err ? -1 : 0;
+}
+
+#else
+int vobject_read_files(char *const *files, int nfiles, size_t lazy,
+		const struct vobject_sax *sax,
+		void (*cb)(struct vobject *vo, int idx, void *dat), void *dat)
+{
+	return vfiles_read_sync(files, nfiles, lazy, sax, cb, dat);
+}
+#endif
@@ -21,6 +21,12 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include "vobject.h"
 
@@ -41,6 +47,7 @@
 static const char help_msg[] =
 	NAME ": filter VCard properties\n"
 	"usage:	" NAME " [OPTIONS ...] NEEDLE [FILE ...]\n"
+	"	" NAME " --daemon [-v] [FILE ...]\n"
 	"\n"
 	"Options\n"
 	" -V, --version		Show version\n"
@@ -50,11 +57,18 @@ static const char help_msg[] =
 	" -s, --swap		Output property, then name, then metadata\n"
 	" -M, --mutt		Output for Mutt (prop=EMAIL, swap + header line)\n"
 	" -L, --short-list	Output a (comma-seperated) list of matched names\n"
+	" -j, --jobs=N		Parse with N threads\n"
+	" -n, --no-cache		Don't use the cache nor the index\n"
+	" -I, --build-index	Build the search index of the files, no NEEDLE\n"
 	"\n"
 	"Arguments\n"
 	" NEEDLE	The text to look for in NAME or <PROP>\n"
 	" FILE		Files to use, '-' for stdin\n"
 	"		No files means 'stdin only'\n"
+	"\n"
+	"With --daemon, " NAME " keeps FILE, or the configured files, parsed\n"
+	"in memory, and answers the queries of other " NAME " commands.\n"
+	"Without a running daemon, " NAME " searches by itself.\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -67,37 +81,91 @@ static struct option long_opts[] = {
 	{ "swap", no_argument, NULL, 's', },
 	{ "mutt", no_argument, NULL, 'M', },
 	{ "short-list", no_argument, NULL, 'L', },
+	{ "jobs", required_argument, NULL, 'j', },
+	{ "no-cache", no_argument, NULL, 'n', },
+	{ "build-index", no_argument, NULL, 'I', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?p:sML";
+static const char optstring[] = "Vv?p:sMLj:nI";
 
 /* program variables */
 static int verbose;
 /* print value first, then name, then metadata (like for Mutt) */
 static int swapoutput;
 static int shortlist;
+static int jobs;
+static int nocache;
 
 /* configuration values */
 static char **files;
 static int nfiles, rfiles; /* used & reserved files */
 
 /* generic file open method */
-static FILE *myfopen(const char *filename, const char *mode)
+static char *mypath(const char *filename)
 {
-	if (*filename == '~') {
-		char *tmp;
-		FILE *fp;
+	char *tmp;
 
+	if (*filename == '~')
 		asprintf(&tmp, "%s/%s", getenv("HOME"), filename+2);
-		fp = fopen(tmp, mode);
-		free(tmp);
-		return fp;
-	} else
-		return fopen(filename, mode);
+	else
+		tmp = strdup(filename);
+	return tmp;
+}
+
+static FILE *myfopen(const char *filename, const char *mode)
+{
+	char *tmp;
+	FILE *fp;
+
+	tmp = mypath(filename);
+	fp = fopen(tmp, mode);
+	free(tmp);
+	return fp;
+}
+
+/* create the directories of @path, before building a cache file */
+static void mkcachedir(const char *path)
+{
+	char *dir, *str;
+
+	dir = strdup(path);
+	if (!dir)
+		elog(1, errno, "strdup");
+	for (str = strchr(dir+1, '/'); str; str = strchr(str+1, '/')) {
+		*str = 0;
+		mkdir(dir, 0700);
+		*str = '/';
+	}
+	free(dir);
+}
+
+/* cache file for @filename: ~/.cache/vofind/<real path><suffix> */
+static char *cachepath(const char *filename, const char *suffix)
+{
+	char *real, *dir, *str, *tmp;
+
+	real = realpath(filename, NULL);
+	if (!real)
+		return NULL;
+	if (getenv("XDG_CACHE_HOME"))
+		asprintf(&dir, "%s/vofind", getenv("XDG_CACHE_HOME"));
+	else if (getenv("HOME"))
+		asprintf(&dir, "%s/.cache/vofind", getenv("HOME"));
+	else {
+		free(real);
+		return NULL;
+	}
+	for (str = real; *str; ++str)
+		if (*str == '/')
+			*str = '%';
+	asprintf(&tmp, "%s/%s%s", dir, real, suffix);
+	free(dir);
+	free(real);
+	return tmp;
 }
 
 /* parse config file */
@@ -166,10 +234,10 @@ static int savestrvector(char *str, int sep, char **vec, int rvec)
 	return nvec;
 }
 
-static void cleanupstrvector(char **vec, int sep)
+static void cleanupstrvector(char **vec, int nvec, int sep)
 {
-	/* restore seperators */
-	for (; *vec; ++vec)
+	/* restore seperators, the last element keeps its terminator */
+	for (; nvec > 1; --nvec, ++vec)
 		(*vec)[strlen(*vec)] = sep;
 }
 
@@ -195,26 +263,21 @@ static const char *vprop_meta_str(const char *prop)
 	return (ostr > buf) ? buf : NULL;
 }
 
-static int showall_prop(const char *propname)
+static int showall_prop(const char *prop)
 {
-	static const char *const propnames[] = {
-		"N",
-		"ADR",
-		"EMAIL",
-		"TEL",
-		"URL",
-		"ORG",
-		"TITLE",
-		"NOTE",
-		NULL,
-	};
-
-	const char *const *lp;
-
-	for (lp = propnames; *lp; ++lp)
-		if (!strcasecmp(*lp, propname))
-			return 1;
-	return 0;
+	switch (vprop_atom(prop)) {
+	case VA_N:
+	case VA_ADR:
+	case VA_EMAIL:
+	case VA_TEL:
+	case VA_URL:
+	case VA_ORG:
+	case VA_TITLE:
+	case VA_NOTE:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
 /* print browsing result */
@@ -224,7 +287,7 @@ void vcard_showall_result(struct vobject *vc, long bitmask)
 	int nvec, j;
 	char *vec[16];
 
-	printf("%s\n", vobject_prop(vc, "FN") ?: "<no name>");
+	printf("%s\n", vobject_prop_atom(vc, VA_FN) ?: "<no name>");
 
 	for (prop = vobject_first_prop(vc); prop; prop = vprop_next(prop)) {
 		if (!showall_prop(prop))
@@ -236,7 +299,7 @@ void vcard_showall_result(struct vobject *vc, long bitmask)
 			printf("[%s]\t", meta);
 
 		nvec = savestrvector((char *)vprop_value(prop), ';', vec, 16);
-		if (!strcasecmp("ADR", prop)) {
+		if (vprop_atom(prop) == VA_ADR) {
 			int chrs = 0;
 
 			if (vec[0] && vec[0][0])
@@ -251,7 +314,7 @@ void vcard_showall_result(struct vobject *vc, long bitmask)
 				chrs += printf("%s%s", chrs ? ", " : "", vec[4]);
 			if (vec[6] && vec[6][0])
 				chrs += printf("%s%s", chrs ? ", " : "", vec[6]);
-		} else if (!strcasecmp("N", prop)) {
+		} else if (vprop_atom(prop) == VA_N) {
 			if (vec[3] && vec[3][0])
 				printf("%s ", vec[3]);
 			if (vec[1] && vec[1][0])
@@ -267,7 +330,7 @@ void vcard_showall_result(struct vobject *vc, long bitmask)
 				printf("%s%s", j ? ", " : "", vec[j]);
 		}
 		printf("\n");
-		cleanupstrvector(vec, ';');
+		cleanupstrvector(vec, nvec, ';');
 	}
 }
 
@@ -276,10 +339,10 @@ static int result_cnt;
 void vcard_add_result(struct vobject *vc, const char *lookfor, long bitmask)
 {
 	const char *name, *meta, *prop;
-	int nprop = 0;
+	int nprop = 0, lookatom, j;
 
 	if (shortlist) {
-		name = vobject_prop(vc, "FN") ?: "??";
+		name = vobject_prop_atom(vc, VA_FN) ?: "??";
 		printf("%s%s", result_cnt++ ? ", " : "", name);
 		return;
 	}
@@ -290,13 +353,13 @@ void vcard_add_result(struct vobject *vc, const char *lookfor, long bitmask)
 		return;
 	}
 
-	name = vobject_prop(vc, "FN") ?: "<no name>";
+	name = vobject_prop_atom(vc, VA_FN) ?: "<no name>";
 
-	for (prop = vobject_first_prop(vc); prop; prop = vprop_next(prop)) {
-		if (lookfor && strcasecmp(lookfor, prop))
-			continue;
+	lookatom = vobject_atom(lookfor);
+	for (j = 0; (j = vobject_find_atom(vc, lookatom, j)) >= 0; ++j) {
 		if (!(bitmask & (1L << nprop++)))
 			continue;
+		prop = vobject_prop_at(vc, j);
 		if (swapoutput)
 			printf("%s\t%s", vprop_value(prop), name);
 		else
@@ -311,7 +374,7 @@ void vcard_add_result(struct vobject *vc, const char *lookfor, long bitmask)
 /* return a searchable telephone nr. */
 static const char *searchable_telnr(const char *str)
 {
-	static char buf[128];
+	static __thread char buf[128];
 	char *tel = buf;
 
 	/* allow leading + */
@@ -336,64 +399,538 @@ static const char *clean_telnr(const char *str)
 	return str;
 }
 
+/* filter state, while streaming */
+struct filter {
+	const char *needle, *lookfor;
+	/* file being processed, for vobject_read_files */
+	char *const *files;
+	int file;
+	int level, isvcard;
+	int nprop, propcnt;
+	long bitmask;
+	int lookatom;
+};
+
+static void filter_begin(const char *type, void *dat)
+{
+	struct filter *f = dat;
+
+	if (f->level++)
+		/* nested vobject */
+		return;
+	f->isvcard = !strcasecmp(type, "VCARD");
+	f->nprop = 0;
+	f->propcnt = 0;
+	f->bitmask = 0;
+	f->lookatom = f->lookfor ? vobject_atom(f->lookfor) : VA_UNKNOWN;
+}
+
+static void filter_atom(struct filter *f, int atom, const char *propval)
+{
+	if (f->level != 1 || !f->isvcard)
+		return;
+	if (!propval)
+		/* out-of-line values, like PHOTO, are not searched */
+		propval = "";
+	/* match in name */
+	if (atom == VA_FN || atom == VA_N) {
+		if (strcasestr(propval, f->needle))
+			f->bitmask = ~0L;
+	} else if (!f->lookfor || atom == f->lookatom) {
+		/* count props */
+		++f->propcnt;
+		if (atom == VA_TEL) {
+			propval = searchable_telnr(propval);
+			if (strcasestr(clean_telnr(searchable_telnr(propval)), clean_telnr(f->needle)))
+				f->bitmask |= 1L << f->nprop;
+		} else if (strcasestr(propval, f->needle))
+			f->bitmask |= 1L << f->nprop;
+		++f->nprop;
+	}
+}
+
+static void filter_prop(const char *prop, const char *propval, void *dat)
+{
+	filter_atom(dat, vobject_atom(prop), propval);
+}
+
+static int filter_end(const char *type, void *dat)
+{
+	struct filter *f = dat;
+
+	/* only build matching vcards */
+	return !--f->level && f->isvcard && f->bitmask && f->propcnt;
+}
+
+static void filter_built(struct vobject *vc, void *dat)
+{
+	struct filter *f = dat;
+
+	/* remember the matching props */
+	vobject_set_priv(vc, (void *)f->bitmask);
+}
+
+static const struct vobject_sax filter_sax = {
+	.begin = filter_begin,
+	.prop = filter_prop,
+	.end = filter_end,
+	.built = filter_built,
+};
+
+/* filter a complete vobject, for parallel parsing */
+static int filter_vobject(struct vobject *vc, void *dat)
+{
+	struct filter f = *(const struct filter *)dat;
+	int j, n;
+
+	filter_begin(vobject_type(vc), &f);
+	for (j = 0, n = vobject_nprops(vc); j < n; ++j)
+		filter_atom(&f, vobject_atom_at(vc, j), vobject_value_at(vc, j, NULL));
+	if (!filter_end(vobject_type(vc), &f))
+		return 0;
+	/* remember the matching props */
+	vobject_set_priv(vc, (void *)f.bitmask);
+	return 1;
+}
+
+static void filter_result(struct vobject *vc, void *dat)
+{
+	const struct filter *f = dat;
+
+	vcard_add_result(vc, f->lookfor, (long)vobject_get_priv(vc));
+	vobject_free(vc);
+}
+
+static void filter_files_result(struct vobject *vc, int idx, void *dat)
+{
+	struct filter *f = dat;
+
+	if (vc) {
+		filter_result(vc, dat);
+		return;
+	}
+	/* new file */
+	f->file = idx;
+	if (verbose)
+		printf("## %s\n", f->files[idx]);
+}
+
 /* real filter program */
 int vcard_filter(FILE *fp, const char *needle, const char *lookfor)
 {
+	struct vobject_reader *rd;
 	struct vobject *vc;
-	int linenr = 0, ncards = 0, nprop, propcnt;
-	long bitmask;
-	const char *prop, *propval;
+	int ncards = 0;
+	struct filter f = {
+		.needle = needle,
+		.lookfor = lookfor,
+	};
+	char *dat;
+	size_t len;
 
-	while (1) {
-		vc = vobject_next(fp, &linenr);
+	if (jobs > 1) {
+		dat = vobject_mmap(fileno(fp), &len);
+		if (dat) {
+			ncards = vobject_parse_parallel(dat, dat+len, -1, jobs,
+					filter_vobject, filter_result, &f);
+			vobject_munmap(dat, len);
+			return ncards;
+		}
+		/* not mappable, use the stream */
+	}
+
+	rd = vobject_reader_fd(fileno(fp), 0);
+	vobject_reader_lazy(rd, VOBJECT_LAZY_SIZE);
+	while (vobject_reader_sax(rd, &filter_sax, &f, &vc)) {
 		if (!vc)
+			continue;
+		vcard_add_result(vc, lookfor, f.bitmask);
+		vobject_free(vc);
+	}
+	vobject_reader_free(rd);
+	return ncards;
+}
+
+/* search index fields */
+enum {
+	FIELD_NAME,
+	FIELD_EMAIL,
+	FIELD_TEL,
+};
+
+/* searchable strings of a vcard, as filter_prop searches them */
+static void vcard_terms(const struct vobject *vc, struct vobject_index_terms *t)
+{
+	const char *prop;
+
+	for (prop = vobject_first_prop(vc); prop; prop = vprop_next(prop)) {
+		switch (vprop_atom(prop)) {
+		case VA_FN:
+		case VA_N:
+			vobject_index_add(t, FIELD_NAME, vprop_value(prop));
 			break;
-		if (strcasecmp(vobject_type(vc), "VCARD")) {
-			/* skip */
+		case VA_EMAIL:
+			vobject_index_add(t, FIELD_EMAIL, vprop_value(prop));
+			break;
+		case VA_TEL:
+			vobject_index_add(t, FIELD_TEL,
+				clean_telnr(searchable_telnr(vprop_value(prop))));
+			break;
+		}
+	}
+}
+
+static void vcard_build_index(const char *path)
+{
+	char *indexfile;
+
+	indexfile = cachepath(path, ".idx");
+	if (!indexfile)
+		elog(1, errno, "no index for %s", path);
+	mkcachedir(indexfile);
+	if (vobject_index_build(path, indexfile, vcard_terms) < 0)
+		elog(1, errno, "index %s", path);
+	if (verbose)
+		printf("## %s: %s\n", path, indexfile);
+	free(indexfile);
+}
+
+/*
+ * candidate vobjects for a query, in file order
+ * Returns -1 when the index cannot serve this query
+ */
+static int vcard_candidates(struct vobject_index *idx, const char *needle,
+		const char *lookfor, int **pobjs)
+{
+	int field, *names, *props, *objs, nnames, nprops, nobjs, j, k;
+
+	/* the index covers only names, and EMAIL & TEL */
+	if (!lookfor)
+		return -1;
+	else if (!strcasecmp(lookfor, "EMAIL"))
+		field = FIELD_EMAIL;
+	else if (!strcasecmp(lookfor, "TEL"))
+		field = FIELD_TEL;
+	else
+		return -1;
+
+	nnames = vobject_index_lookup(idx, FIELD_NAME, needle, &names);
+	nprops = vobject_index_lookup(idx, field, (field == FIELD_TEL) ?
+			clean_telnr(needle) : needle, &props);
+	if (nnames < 0 || nprops < 0) {
+		free(names);
+		free(props);
+		return -1;
+	}
+	/* merge both lists */
+	objs = malloc((nnames + nprops) * sizeof(*objs) ?: 1);
+	if (!objs)
+		elog(1, errno, "malloc");
+	for (j = k = nobjs = 0; j < nnames || k < nprops; ) {
+		if (k >= nprops || (j < nnames && names[j] < props[k]))
+			objs[nobjs++] = names[j++];
+		else if (j >= nnames || props[k] < names[j])
+			objs[nobjs++] = props[k++];
+		else {
+			objs[nobjs++] = names[j++];
+			++k;
+		}
+	}
+	free(names);
+	free(props);
+	*pobjs = objs;
+	return nobjs;
+}
+
+/* resident pool of parsed files, in the daemon */
+struct pool {
+	char *path;
+	struct stat st;
+	struct vobject **vobjs;
+	int nvobjs, svobjs;
+	/* index, numbered like vobjs */
+	struct vobject_index *idx;
+};
+
+static struct pool *pool;
+static int npool;
+
+/* (re)load a pool file when it changed */
+static void pool_load(struct pool *p)
+{
+	struct vobject *vo;
+	struct stat st;
+	char *dat, *pos, *indexfile;
+	size_t len;
+	int fd, j;
+
+	fd = open(p->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		elog(0, errno, "open %s", p->path);
+		memset(&st, 0, sizeof(st));
+	}
+	if (st.st_size == p->st.st_size && st.st_ino == p->st.st_ino &&
+			st.st_mtim.tv_sec == p->st.st_mtim.tv_sec &&
+			st.st_mtim.tv_nsec == p->st.st_mtim.tv_nsec)
+		goto done;
+
+	for (j = 0; j < p->nvobjs; ++j)
+		vobject_free(p->vobjs[j]);
+	p->nvobjs = 0;
+	if (p->idx)
+		vobject_index_close(p->idx);
+	p->idx = NULL;
+	p->st = st;
+	if (fd < 0)
+		return;
+	/* parse like vobject_index_build, for identical numbering */
+	dat = vobject_mmap(fd, &len);
+	if (!dat) {
+		if (st.st_size)
+			elog(0, errno, "mmap %s", p->path);
+		goto done;
+	}
+	for (pos = dat; (vo = vobject_next_mem(&pos, dat+len, NULL)) != NULL; ) {
+		if (p->nvobjs >= p->svobjs) {
+			p->svobjs = p->svobjs * 2 ?: 256;
+			p->vobjs = realloc(p->vobjs, p->svobjs * sizeof(*p->vobjs));
+			if (!p->vobjs)
+				elog(1, errno, "realloc %i", p->svobjs);
+		}
+		/* detach from the mapping */
+		p->vobjs[p->nvobjs++] = vobject_dup(vo);
+		vobject_free(vo);
+	}
+	vobject_munmap(dat, len);
+
+	indexfile = cachepath(p->path, ".idx");
+	if (indexfile) {
+		p->idx = vobject_index_open(p->path, indexfile);
+		if (!p->idx) {
+			mkcachedir(indexfile);
+			if (vobject_index_build(p->path, indexfile, vcard_terms) == 0)
+				p->idx = vobject_index_open(p->path, indexfile);
+		}
+		free(indexfile);
+	}
+	if (verbose)
+		elog(0, 0, "loaded %s, %i vobjects%s", p->path, p->nvobjs,
+				p->idx ? ", indexed" : "");
+done:
+	if (fd >= 0)
+		close(fd);
+}
+
+static void pool_add(const char *filename)
+{
+	char *path;
+
+	path = mypath(filename);
+	pool = realloc(pool, (npool+1) * sizeof(*pool));
+	if (!pool)
+		elog(1, errno, "realloc");
+	memset(pool+npool, 0, sizeof(*pool));
+	pool[npool].path = realpath(path, NULL) ?: strdup(path);
+	pool_load(pool+npool);
+	++npool;
+	free(path);
+}
+
+/* the pool file of @path, if any */
+static struct pool *pool_find(const char *path)
+{
+	struct pool *p;
+	char *real;
+
+	if (!npool)
+		return NULL;
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+	for (p = pool; p < pool+npool; ++p)
+		if (!strcmp(p->path, real))
+			break;
+	free(real);
+	return (p < pool+npool) ? p : NULL;
+}
+
+/*
+ * where the vobjects of a file come from, without parsing it:
+ * the pool, the index or the cache
+ * The index yields candidates, which are verified by the regular filter.
+ */
+struct source {
+	struct pool *pool;
+	struct vobject_index *idx;
+	/* candidates of the pool or index, -1 for all */
+	int *objs, nobjs;
+	struct vobject_cache *cache;
+};
+
+/* returns -1 when @path needs a parse */
+static int source_open(struct source *s, const char *path, const char *needle,
+		const char *lookfor)
+{
+	char *file;
+
+	memset(s, 0, sizeof(*s));
+	s->pool = pool_find(path);
+	if (s->pool) {
+		s->nobjs = s->pool->idx ? vcard_candidates(s->pool->idx, needle,
+				lookfor, &s->objs) : -1;
+		return 0;
+	}
+	if (nocache)
+		return -1;
+
+	file = cachepath(path, ".idx");
+	if (file) {
+		s->idx = vobject_index_open(path, file);
+		free(file);
+	}
+	if (s->idx) {
+		s->nobjs = vcard_candidates(s->idx, needle, lookfor, &s->objs);
+		if (s->nobjs >= 0)
+			return 0;
+		/* the index cannot serve this query */
+		vobject_index_close(s->idx);
+		s->idx = NULL;
+	}
+
+	file = cachepath(path, "");
+	if (file) {
+		s->cache = vobject_cache_open(path, file);
+		if (!s->cache && errno == ENOENT) {
+			/* no cache directory yet */
+			mkcachedir(file);
+			s->cache = vobject_cache_open(path, file);
+		}
+		free(file);
+	}
+	return s->cache ? 0 : -1;
+}
+
+static int source_nobjs(const struct source *s)
+{
+	if (s->nobjs >= 0)
+		return s->nobjs;
+	return s->pool->nvobjs;
+}
+
+static struct vobject *source_get(const struct source *s, int j)
+{
+	if (s->nobjs >= 0)
+		j = s->objs[j];
+	if (s->idx)
+		return vobject_index_get(s->idx, j);
+	return (j < s->pool->nvobjs) ? s->pool->vobjs[j] : NULL;
+}
+
+/* filter the vobjects of a source, and close it */
+static void source_filter(struct source *s, const char *needle,
+		const char *lookfor)
+{
+	struct vobject *vc;
+	int j, n;
+	struct filter f = {
+		.needle = needle,
+		.lookfor = lookfor,
+	};
+
+	if (s->cache) {
+		vobject_cache_sax(s->cache, &filter_sax, &f, filter_result);
+		vobject_cache_close(s->cache);
+		return;
+	}
+	for (j = 0, n = source_nobjs(s); j < n; ++j) {
+		vc = source_get(s, j);
+		if (!vc)
+			continue;
+		if (s->pool) {
+			/* the pool keeps its vobjects */
+			if (filter_vobject(vc, &f))
+				vcard_add_result(vc, lookfor,
+						(long)vobject_get_priv(vc));
+		} else if (filter_vobject(vc, &f))
+			filter_result(vc, &f);
+		else
 			vobject_free(vc);
+	}
+	free(s->objs);
+	if (s->idx)
+		vobject_index_close(s->idx);
+}
+
+/*
+ * filter many files
+ * The files that the pool, index or cache cannot serve are read
+ * concurrently. Results come in the order of the files.
+ */
+static void vcard_filter_files(char *const *files, int nfiles,
+		const char *needle, const char *lookfor)
+{
+	struct source *srcs;
+	char **paths;
+	FILE *fp;
+	int *parse, j, k;
+	struct filter f = {
+		.needle = needle,
+		.lookfor = lookfor,
+	};
+
+	paths = calloc(nfiles, sizeof(*paths));
+	srcs = calloc(nfiles, sizeof(*srcs));
+	parse = calloc(nfiles, sizeof(*parse));
+	if (!paths || !srcs || !parse)
+		elog(1, errno, "calloc");
+	for (j = 0; j < nfiles; ++j) {
+		paths[j] = mypath(files[j]);
+		parse[j] = source_open(srcs+j, paths[j], needle, lookfor) < 0;
+	}
+	for (j = 0; j < nfiles; j = k) {
+		if (!parse[j]) {
+			if (verbose)
+				printf("## %s\n", files[j]);
+			source_filter(srcs+j, needle, lookfor);
+			k = j+1;
 			continue;
 		}
-		nprop = 0;
-		propcnt = 0;
-		bitmask = 0;
-		for (prop = vobject_first_prop(vc); prop; prop = vprop_next(prop)) {
-			/* match in name */
-			if (!strcasecmp(prop, "FN")) {
-				if (strcasestr(vprop_value(prop), needle))
-					bitmask = ~0L;
-			} else if (!strcasecmp(prop, "N")) {
-				if (strcasestr(vprop_value(prop), needle))
-					bitmask = ~0L;
-			} else if (!lookfor || !strcasecmp(prop, lookfor)) {
-				/* count props */
-				++propcnt;
-				propval = vprop_value(prop);
-				if (!strcasecmp(prop, "TEL")) {
-					propval = searchable_telnr(propval);
-					if (strcasestr(clean_telnr(searchable_telnr(propval)), clean_telnr(needle)))
-						bitmask |= 1L << nprop;
-				} else if (strcasestr(propval, needle))
-					bitmask |= 1L << nprop;
-				++nprop;
+		for (k = j; k < nfiles && parse[k]; ++k);
+		if (jobs > 1) {
+			/* parallel parses, file by file */
+			for (; j < k; ++j) {
+				fp = fopen(paths[j], "r");
+				if (!fp)
+					elog(1, errno, "fopen %s", paths[j]);
+				if (verbose)
+					printf("## %s\n", files[j]);
+				vcard_filter(fp, needle, lookfor);
+				fclose(fp);
 			}
+			continue;
 		}
-		if (bitmask && propcnt)
-			vcard_add_result(vc, lookfor, bitmask);
-		vobject_free(vc);
+		f.files = files+j;
+		f.file = -1;
+		if (vobject_read_files(paths+j, k-j, VOBJECT_LAZY_SIZE,
+					&filter_sax, filter_files_result, &f) < 0)
+			elog(1, errno, "fopen %s", files[j+f.file+1]);
 	}
-	return ncards;
+	for (j = 0; j < nfiles; ++j)
+		free(paths[j]);
+	free(paths);
+	free(srcs);
+	free(parse);
 }
 
-int main(int argc, char *argv[])
+static int vofind(int argc, char *argv[])
 {
 	int opt, j;
 	const char *needle;
 	const char *lookfor = NULL;
 	FILE *fp;
-	int mutt = 0;
+	int mutt = 0, buildindex = 0;
+	char *path;
 
-	parse_config("/etc/vofind.conf");
-	parse_config("~/.vofind");
 	/* argument parsing */
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
 	switch (opt) {
@@ -419,6 +956,15 @@ int main(int argc, char *argv[])
 	case 'L':
 		shortlist = 1;
 		break;
+	case 'j':
+		jobs = strtoul(optarg, NULL, 0);
+		break;
+	case 'n':
+		nocache = 1;
+		break;
+	case 'I':
+		buildindex = 1;
+		break;
 	case '?':
 		fputs(help_msg, stderr);
 		exit(0);
@@ -429,6 +975,19 @@ int main(int argc, char *argv[])
 		break;
 	}
 
+	if (buildindex) {
+		if (argv[optind])
+			for (; argv[optind]; ++optind)
+				vcard_build_index(argv[optind]);
+		else
+			for (j = 0; j < nfiles; ++j) {
+				path = mypath(files[j]);
+				vcard_build_index(path);
+				free(path);
+			}
+		return 0;
+	}
+
 	if (optind >= argc) {
 		fprintf(stderr, "no search string");
 		fputs(help_msg, stderr);
@@ -441,7 +1000,11 @@ int main(int argc, char *argv[])
 		printf("%s %s\n", NAME, VERSION);
 
 	/* filter from file(s) */
-	if (argv[optind])
+	if ((jobs <= 1 || npool) && argv[optind])
+		vcard_filter_files(argv+optind, argc-optind, needle, lookfor);
+	else if ((jobs <= 1 || npool) && nfiles)
+		vcard_filter_files(files, nfiles, needle, lookfor);
+	else if (argv[optind])
 	for (; argv[optind]; ++optind) {
 		fp = myfopen(argv[optind], "r");
 		if (!fp)
@@ -463,11 +1026,320 @@ int main(int argc, char *argv[])
 		vcard_filter(stdin, needle, lookfor);
 	if (shortlist && result_cnt)
 		printf("\n");
+	return 0;
+}
+
+
+/* query daemon */
+
+/*
+ * the socket, in a directory of our own
+ * Returns NULL when that directory belongs to another user,
+ * or is accessible to others.
+ */
+static char *sockpath(int create)
+{
+	struct stat st;
+	char *dir, *path;
+
+	if (getenv("XDG_RUNTIME_DIR"))
+		/* a private directory by definition */
+		asprintf(&dir, "%s", getenv("XDG_RUNTIME_DIR"));
+	else {
+		asprintf(&dir, "/tmp/vofind-%u", getuid());
+		if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+			elog(1, errno, "mkdir %s", dir);
+	}
+	if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+			st.st_uid != getuid() || (st.st_mode & 077)) {
+		if (create)
+			elog(0, 0, "%s is not a private directory", dir);
+		free(dir);
+		return NULL;
+	}
+	asprintf(&path, "%s/vofind.sock", dir);
+	free(dir);
+	return path;
+}
+
+/* connect to the daemon of our own user, returns -1 when none runs */
+static int sockconnect(const struct sockaddr_un *addr)
+{
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (void *)addr, sizeof(*addr)) < 0)
+		goto fail;
+	/* never pass our files to another user */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+			cred.uid != getuid())
+		goto fail;
+	return sock;
+fail:
+	close(sock);
+	return -1;
+}
+
+/* request: cwd, argv, all 0 terminated, with stdin, stdout & stderr */
+#define REQSIZE	65536
+/* seconds to wait for a request */
+#define SOCKTIMEOUT	10
+
+union fdmsg {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+};
+
+/* the client of the query, in the forked daemon */
+static int query_conn = -1;
+
+/* pass the exit code of the query to the client */
+static void daemon_reply(int exitcode, void *dat)
+{
+	fflush(stdout);
+	fflush(stderr);
+	send(query_conn, &exitcode, sizeof(exitcode), MSG_NOSIGNAL);
+}
+
+/*
+ * run 1 query, in a forked daemon, on the files & directory of the client
+ * The query may exit anywhere, its process releases all it used.
+ */
+__attribute__((noreturn))
+static void daemon_serve(int conn)
+{
+	static char req[REQSIZE];
+	union fdmsg ctl;
+	struct iovec iov = { .iov_base = req, .iov_len = sizeof(req), };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &ctl,
+		.msg_controllen = sizeof(ctl),
+	};
+	struct timeval tv = { .tv_sec = SOCKTIMEOUT, };
+	struct cmsghdr *cmsg;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	int fds[3] = { -1, -1, -1, }, ret, argc, nfds, fd, j;
+	char *argv[1024], *str;
+
+	/* a client that does not talk must not keep us */
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	ret = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0) {
+		elog(0, errno, "recvmsg");
+		_exit(1);
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		/* take stdin, stdout & stderr, close anything else */
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (j = 0; j < nfds; ++j) {
+			memcpy(&fd, CMSG_DATA(cmsg) + j*sizeof(int), sizeof(fd));
+			if (nfds == 3 && fds[j] < 0)
+				fds[j] = fd;
+			else
+				close(fd);
+		}
+	}
+	if (fds[2] < 0 || !ret || req[ret-1] || (msg.msg_flags & MSG_TRUNC))
+		goto done;
+	/* serve our own user only */
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+			cred.uid != getuid())
+		goto done;
+
+	/* the working directory preceeds argv */
+	for (argc = 0, str = req; str < req+ret && argc < 1023; str += strlen(str)+1)
+		argv[argc++] = str;
+	argv[argc] = NULL;
+	if (argc < 2)
+		goto done;
+
+	if (chdir(argv[0]) < 0) {
+		dprintf(fds[2], "%s: chdir %s\n\t: %s\n", NAME, argv[0],
+				strerror(errno));
+		ret = 1;
+		send(conn, &ret, sizeof(ret), MSG_NOSIGNAL);
+		goto done;
+	}
+	for (j = 0; j < 3; ++j) {
+		dup2(fds[j], j);
+		close(fds[j]);
+	}
+	/* the query has its own options */
+	verbose = 0;
+	query_conn = conn;
+	on_exit(daemon_reply, NULL);
+	exit(vofind(argc-1, argv+1));
+done:
+	for (j = 0; j < 3; ++j)
+		if (fds[j] >= 0)
+			close(fds[j]);
+	_exit(1);
+}
+
+static int vofind_daemon(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	char *path;
+	int sock, conn, j;
+	pid_t pid;
+
+	for (j = 1; j < argc; ++j) {
+		if (!strcmp(argv[j], "-v") || !strcmp(argv[j], "--verbose"))
+			++verbose;
+	}
+	path = sockpath(1);
+	if (!path)
+		exit(1);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		elog(1, 0, "socket path %s too long", path);
+	strcpy(addr.sun_path, path);
+	sock = sockconnect(&addr);
+	if (sock >= 0)
+		elog(1, 0, "a daemon serves %s already", path);
+
+	/* the queries use this config */
+	parse_config("/etc/vofind.conf");
+	parse_config("~/.vofind");
+	/* fill the pool */
+	for (j = 1; j < argc; ++j) {
+		if (strcmp(argv[j], "--daemon") && strcmp(argv[j], "-v") &&
+				strcmp(argv[j], "--verbose"))
+			pool_add(argv[j]);
+	}
+	if (!npool)
+		for (j = 0; j < nfiles; ++j)
+			pool_add(files[j]);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		elog(1, errno, "socket");
+	/* a stale socket, nobody answered */
+	unlink(path);
+	umask(077);
+	if (bind(sock, (void *)&addr, sizeof(addr)) < 0)
+		elog(1, errno, "bind %s", path);
+	if (listen(sock, 16) < 0)
+		elog(1, errno, "listen %s", path);
+	free(path);
+	/* a client that went away must not end the daemon */
+	signal(SIGPIPE, SIG_IGN);
+	/* no zombie queries */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;) {
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			elog(1, errno, "accept");
+		}
+		/* reload changed files here, for all later queries */
+		for (j = 0; j < npool; ++j)
+			pool_load(pool+j);
+		/* queries run concurrently, on a copy of the pool */
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid < 0)
+			elog(0, errno, "fork");
+		if (!pid) {
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			daemon_serve(conn);
+		}
+		close(conn);
+	}
+	return 0;
+}
+
+/* pass the query to the daemon, returns -1 when no daemon runs */
+static int vofind_client(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	static char req[REQSIZE];
+	union fdmsg ctl;
+	struct iovec iov = { .iov_base = req, };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &ctl,
+		.msg_controllen = sizeof(ctl),
+	};
+	struct cmsghdr *cmsg;
+	static const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, };
+	char *path;
+	size_t len;
+	int sock, j, ret;
+
+	path = sockpath(0);
+	if (!path)
+		return -1;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		free(path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	free(path);
+
+	/* compose the request */
+	if (!getcwd(req, sizeof(req)))
+		return -1;
+	len = strlen(req)+1;
+	for (j = 0; j < argc; ++j) {
+		if (len + strlen(argv[j])+1 > sizeof(req))
+			return -1;
+		strcpy(req+len, argv[j]);
+		len += strlen(argv[j])+1;
+	}
+	iov.iov_len = len;
+	memset(&ctl, 0, sizeof(ctl));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	sock = sockconnect(&addr);
+	if (sock < 0)
+		return -1;
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		close(sock);
+		return -1;
+	}
+	/* wait for the exit code */
+	if (recv(sock, &ret, sizeof(ret), 0) != sizeof(ret))
+		elog(1, errno, "daemon did not complete");
+	close(sock);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, j;
+
+	for (j = 1; j < argc; ++j)
+		if (!strcmp(argv[j], "--daemon"))
+			return vofind_daemon(argc, argv);
+	ret = vofind_client(argc, argv);
+	if (ret >= 0)
+		return ret;
+	parse_config("/etc/vofind.conf");
+	parse_config("~/.vofind");
+	ret = vofind(argc, argv);
 	/* make valgrind happy */
 	for (j = 0; j < nfiles; ++j)
 		free(files[j]);
 	if (files)
 		free(files);
-	return 0;
+	return ret;
 }
-
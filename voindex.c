@@ -0,0 +1,626 @@
+/*
+ * Copyright 2014 Kurt Van Dijck <kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vobject.h"
+#include "vopriv.h"
+
+/*
+ * Trigram index of the toplevel vobjects of a file
+ *
+ * The index holds the [start, end) byte offsets of each toplevel vobject
+ * in the source file, and a sorted table of (field, trigram) terms,
+ * each with a posting list of vobject numbers.
+ * Trigrams are case insensitive for ASCII, like strcasestr.
+ *
+ * The UID index has the same header & table of byte offsets, sorted by UID,
+ * followed by the UID and type of each vobject.
+ */
+
+#define VINDEX_MAGIC	"VOINDEX1"
+#define VUIDX_MAGIC	"VOUIDX2"
+
+struct vihdr {
+	char magic[8];
+	/* identification of the source */
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t nobjs;
+	uint64_t nterms;
+	/* struct viobj[nobjs], struct viterm[nterms], postings */
+};
+
+struct viobj {
+	uint64_t start, end;
+};
+
+struct viuid {
+	/* offsets in the string table */
+	uint32_t uid, type;
+	/* 0 for the toplevel vobject, n for its nth child */
+	uint32_t child;
+};
+
+struct viterm {
+	/* field << 24 | trigram */
+	uint32_t key;
+	uint32_t npostings;
+	/* offset of uint32_t postings[npostings] in the file */
+	uint64_t postings;
+};
+
+struct vobject_index {
+	/* the index */
+	char *dat;
+	size_t len;
+	const struct vihdr *hdr;
+	const struct viobj *objs;
+	const struct viterm *terms;
+	const struct viuid *uids;
+	const char *strs;
+	/* the source */
+	int fd;
+};
+
+/* terms collected while building */
+struct vobject_index_terms {
+	/* field << 56 | trigram << 32 | vobject nr */
+	uint64_t *keys;
+	size_t nkeys, skeys;
+	uint32_t obj;
+};
+
+static inline uint32_t trigram(const char *str)
+{
+	return (tolower(*(const unsigned char *)str) << 16) |
+		(tolower(((const unsigned char *)str)[1]) << 8) |
+		tolower(((const unsigned char *)str)[2]);
+}
+
+void vobject_index_add(struct vobject_index_terms *t, int field, const char *str)
+{
+	size_t len;
+
+	if (!str)
+		return;
+	for (len = strlen(str); len >= 3; --len, ++str) {
+		if (t->nkeys >= t->skeys) {
+			t->skeys = t->skeys * 2 ?: 1024;
+			t->keys = realloc(t->keys, t->skeys * sizeof(*t->keys));
+			if (!t->keys)
+				elog(LOG_ERR, errno, "realloc %zu", t->skeys);
+		}
+		t->keys[t->nkeys++] = ((uint64_t)(field & 0xff) << 56) |
+			((uint64_t)trigram(str) << 32) | t->obj;
+	}
+}
+
+/* write an index in a temporary file, and rename it when complete */
+static FILE *vindex_create(const char *indexfile, char **ptmpfile)
+{
+	FILE *fp;
+	int fd;
+
+	if (asprintf(ptmpfile, "%s.XXXXXX", indexfile) < 0)
+		return NULL;
+	fd = mkstemp(*ptmpfile);
+	if (fd < 0)
+		goto fail;
+	/* keep the 0600 of mkstemp, like the cache: the source may be private */
+	fp = fdopen(fd, "w");
+	if (fp)
+		return fp;
+	close(fd);
+	unlink(*ptmpfile);
+fail:
+	free(*ptmpfile);
+	return NULL;
+}
+
+static int vindex_commit(FILE *fp, char *tmpfile, const char *indexfile)
+{
+	int ret = 0;
+
+	if (fclose(fp) || rename(tmpfile, indexfile) < 0) {
+		unlink(tmpfile);
+		ret = -1;
+	}
+	free(tmpfile);
+	return ret;
+}
+
+static int cmpkey(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+int vobject_index_build(const char *file, const char *indexfile,
+		void (*terms)(const struct vobject *vo,
+			struct vobject_index_terms *t))
+{
+	struct vihdr hdr = { .magic = VINDEX_MAGIC, };
+	struct vobject_index_terms t = {};
+	struct viobj *objs = NULL;
+	struct viterm term;
+	size_t sobjs = 0, j, k;
+	struct vobject *vo;
+	struct stat st;
+	char *tmpfile, *dat, *pos, *start;
+	size_t len;
+	uint64_t postings;
+	uint32_t obj;
+	int fd, ret = -1;
+	FILE *fp;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto fail_stat;
+	dat = vobject_mmap(fd, &len);
+	if (!dat && st.st_size)
+		goto fail_stat;
+
+	/* collect the vobjects and their terms */
+	for (pos = start = dat; (vo = vobject_next_mem(&pos, dat+len, NULL)) != NULL;
+			start = pos) {
+		if (hdr.nobjs >= sobjs) {
+			sobjs = sobjs * 2 ?: 1024;
+			objs = realloc(objs, sobjs * sizeof(*objs));
+			if (!objs)
+				elog(LOG_ERR, errno, "realloc %zu", sobjs);
+		}
+		objs[hdr.nobjs].start = start - dat;
+		objs[hdr.nobjs].end = pos - dat;
+		t.obj = hdr.nobjs++;
+		terms(vo, &t);
+		vobject_free(vo);
+	}
+	qsort(t.keys, t.nkeys, sizeof(*t.keys), cmpkey);
+	/* remove duplicates */
+	for (j = k = 0; j < t.nkeys; ++j)
+		if (!k || t.keys[j] != t.keys[k-1])
+			t.keys[k++] = t.keys[j];
+	t.nkeys = k;
+	for (j = 0; j < t.nkeys; ++j)
+		if (!j || (t.keys[j] >> 32) != (t.keys[j-1] >> 32))
+			++hdr.nterms;
+
+	fp = vindex_create(indexfile, &tmpfile);
+	if (!fp)
+		goto fail_tmp;
+	hdr.size = st.st_size;
+	hdr.ino = st.st_ino;
+	hdr.mtime_sec = st.st_mtim.tv_sec;
+	hdr.mtime_nsec = st.st_mtim.tv_nsec;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(objs, sizeof(*objs), hdr.nobjs, fp);
+	/* term table */
+	postings = sizeof(hdr) + hdr.nobjs * sizeof(*objs) +
+		hdr.nterms * sizeof(term);
+	for (j = 0; j < t.nkeys; j = k) {
+		for (k = j+1; k < t.nkeys && (t.keys[k] >> 32) == (t.keys[j] >> 32); ++k);
+		term.key = t.keys[j] >> 32;
+		term.npostings = k - j;
+		term.postings = postings;
+		postings += term.npostings * sizeof(obj);
+		fwrite(&term, sizeof(term), 1, fp);
+	}
+	/* posting lists */
+	for (j = 0; j < t.nkeys; ++j) {
+		obj = t.keys[j];
+		fwrite(&obj, sizeof(obj), 1, fp);
+	}
+	ret = vindex_commit(fp, tmpfile, indexfile);
+fail_tmp:
+	if (t.keys)
+		free(t.keys);
+	if (objs)
+		free(objs);
+	vobject_munmap(dat, len);
+fail_stat:
+	close(fd);
+	return ret;
+}
+
+/* map an index, and verify that it matches the source */
+static struct vobject_index *vindex_open(const char *file,
+		const char *indexfile, const char *magic)
+{
+	struct vobject_index *idx;
+	const struct vihdr *hdr;
+	struct stat st, ist;
+	int fd;
+
+	fd = open(indexfile, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &ist) < 0 || ist.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	idx = malloc(sizeof(*idx));
+	if (!idx)
+		elog(LOG_ERR, errno, "malloc");
+	memset(idx, 0, sizeof(*idx));
+	idx->fd = -1;
+	idx->len = ist.st_size;
+	idx->dat = mmap(NULL, idx->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->dat == MAP_FAILED) {
+		free(idx);
+		return NULL;
+	}
+	idx->fd = open(file, O_RDONLY);
+	if (idx->fd < 0)
+		goto fail;
+
+	/* verify that the index matches the source */
+	hdr = idx->hdr = (const void *)idx->dat;
+	if (fstat(idx->fd, &st) < 0 ||
+			memcmp(hdr->magic, magic, sizeof(hdr->magic)) ||
+			hdr->size != st.st_size || hdr->ino != st.st_ino ||
+			hdr->mtime_sec != st.st_mtim.tv_sec ||
+			hdr->mtime_nsec != st.st_mtim.tv_nsec ||
+			hdr->nobjs > (idx->len - sizeof(*hdr)) / sizeof(struct viobj))
+		goto fail;
+	idx->objs = (const void *)(hdr + 1);
+	return idx;
+fail:
+	vobject_index_close(idx);
+	return NULL;
+}
+
+struct vobject_index *vobject_index_open(const char *file,
+		const char *indexfile)
+{
+	struct vobject_index *idx;
+
+	idx = vindex_open(file, indexfile, VINDEX_MAGIC);
+	if (!idx)
+		return NULL;
+	if (idx->hdr->nterms > (idx->len - sizeof(struct vihdr) -
+				idx->hdr->nobjs * sizeof(struct viobj)) /
+			sizeof(struct viterm)) {
+		vobject_index_close(idx);
+		return NULL;
+	}
+	idx->terms = (const void *)(idx->objs + idx->hdr->nobjs);
+	return idx;
+}
+
+void vobject_index_close(struct vobject_index *idx)
+{
+	if (idx->fd >= 0)
+		close(idx->fd);
+	munmap(idx->dat, idx->len);
+	free(idx);
+}
+
+/* posting list of 1 term */
+static const uint32_t *vindex_postings(const struct vobject_index *idx,
+		uint32_t key, uint32_t *pn)
+{
+	const struct viterm *term;
+	size_t lo = 0, hi = idx->hdr->nterms, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		term = idx->terms + mid;
+		if (term->key == key) {
+			if (term->postings > idx->len || term->npostings >
+					(idx->len - term->postings) / sizeof(uint32_t))
+				break;
+			*pn = term->npostings;
+			return (const void *)(idx->dat + term->postings);
+		} else if (term->key < key)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	*pn = 0;
+	return NULL;
+}
+
+int vobject_index_lookup(struct vobject_index *idx, int field,
+		const char *str, int **pobjs)
+{
+	const uint32_t *post;
+	uint32_t npost, key;
+	size_t len = strlen(str);
+	int *objs, nobjs, j, k, m;
+	const char *pos, *shortest = NULL;
+
+	*pobjs = NULL;
+	if (len < 3)
+		return -1;
+	/* start with the shortest posting list */
+	nobjs = -1;
+	for (pos = str; pos+3 <= str+len; ++pos) {
+		key = (field & 0xff) << 24 | trigram(pos);
+		vindex_postings(idx, key, &npost);
+		if (!npost)
+			return 0;
+		if (nobjs < 0 || npost < nobjs) {
+			nobjs = npost;
+			shortest = pos;
+		}
+	}
+	post = vindex_postings(idx, (field & 0xff) << 24 | trigram(shortest), &npost);
+	objs = malloc(npost * sizeof(*objs));
+	if (!objs)
+		elog(LOG_ERR, errno, "malloc");
+	for (j = 0; j < npost; ++j)
+		objs[j] = post[j];
+
+	/* intersect with the other trigrams */
+	for (pos = str; nobjs && pos+3 <= str+len; ++pos) {
+		if (pos == shortest)
+			continue;
+		post = vindex_postings(idx, (field & 0xff) << 24 | trigram(pos), &npost);
+		for (j = k = m = 0; j < nobjs && k < npost; ) {
+			if (objs[j] < post[k])
+				++j;
+			else if (objs[j] > post[k])
+				++k;
+			else {
+				objs[m++] = objs[j++];
+				++k;
+			}
+		}
+		nobjs = m;
+	}
+	*pobjs = objs;
+	return nobjs;
+}
+
+struct vobject *vobject_index_get(struct vobject_index *idx, int obj)
+{
+	struct vobject *vo, *dup = NULL;
+	const struct vobject *child;
+	char *dat, *pos;
+	size_t len;
+	uint32_t n;
+
+	if (obj < 0 || obj >= idx->hdr->nobjs ||
+			idx->objs[obj].start > idx->objs[obj].end ||
+			idx->objs[obj].end > idx->hdr->size)
+		return NULL;
+	len = idx->objs[obj].end - idx->objs[obj].start;
+	dat = malloc(len);
+	if (!dat)
+		elog(LOG_ERR, errno, "malloc %zu", len);
+	/* the vobject parses in-place, keep the buffer until it is copied */
+	if (pread(idx->fd, dat, len, idx->objs[obj].start) == len) {
+		pos = dat;
+		vo = vobject_next_mem(&pos, dat+len, NULL);
+		if (vo) {
+			n = idx->uids ? idx->uids[obj].child : 0;
+			for (child = vobject_first_child(vo); n > 1 && child;
+					child = vobject_next_child(child), --n);
+			if (!n)
+				dup = vobject_dup(vo);
+			else if (child)
+				dup = vobject_dup_split(vo, child);
+			vobject_free(vo);
+		}
+	}
+	free(dat);
+	return dup;
+}
+
+/* UID index */
+struct uident {
+	uint64_t start, end;
+	char *uid, *type;
+	uint32_t child;
+};
+
+static int cmpuid(const void *a, const void *b)
+{
+	const struct uident *ea = a, *eb = b;
+	int ret;
+
+	ret = strcmp(ea->uid, eb->uid);
+	if (ret)
+		return ret;
+	/* keep file order */
+	if (ea->start != eb->start)
+		return (ea->start > eb->start) - (ea->start < eb->start);
+	return (ea->child > eb->child) - (ea->child < eb->child);
+}
+
+static struct uident *uident_add(struct uident **pents, size_t *pnents,
+		size_t *psents, const char *uid, const struct vobject *vo)
+{
+	struct uident *e;
+
+	if (*pnents >= *psents) {
+		*psents = *psents * 2 ?: 1024;
+		*pents = realloc(*pents, *psents * sizeof(**pents));
+		if (!*pents)
+			elog(LOG_ERR, errno, "realloc %zu", *psents);
+	}
+	e = &(*pents)[(*pnents)++];
+	e->uid = strdup(uid);
+	e->type = strdup(vobject_type(vo));
+	e->child = 0;
+	return e;
+}
+
+int vobject_uidindex_build(const char *file, const char *indexfile)
+{
+	struct vihdr hdr = { .magic = VUIDX_MAGIC, };
+	struct uident *ents = NULL;
+	size_t nents = 0, sents = 0, j;
+	struct viobj obj;
+	struct viuid uid;
+	const struct vobject *child;
+	struct vobject *vo;
+	struct uident *e;
+	struct stat st;
+	const char *str;
+	char *tmpfile, *dat, *pos, *start;
+	size_t len;
+	uint32_t strs, n;
+	int fd, ret = -1;
+	FILE *fp;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto fail_stat;
+	dat = vobject_mmap(fd, &len);
+	if (!dat && st.st_size)
+		goto fail_stat;
+
+	for (pos = start = dat; (vo = vobject_next_mem(&pos, dat+len, NULL)) != NULL;
+			start = pos) {
+		if (vobject_kind(vo) != VK_VCALENDAR) {
+			str = vobject_prop_atom(vo, VA_UID);
+			if (str) {
+				e = uident_add(&ents, &nents, &sents, str, vo);
+				e->start = start - dat;
+				e->end = pos - dat;
+			}
+		} else for (child = vobject_first_child(vo), n = 1; child;
+				child = vobject_next_child(child), ++n) {
+			/* each child by its own UID, like votool split */
+			if (vobject_kind(child) == VK_VTIMEZONE)
+				continue;
+			str = vobject_prop_atom(child, VA_UID);
+			if (!str)
+				continue;
+			e = uident_add(&ents, &nents, &sents, str, child);
+			e->start = start - dat;
+			e->end = pos - dat;
+			e->child = n;
+		}
+		vobject_free(vo);
+	}
+	qsort(ents, nents, sizeof(*ents), cmpuid);
+
+	fp = vindex_create(indexfile, &tmpfile);
+	if (!fp)
+		goto fail_tmp;
+	hdr.size = st.st_size;
+	hdr.ino = st.st_ino;
+	hdr.mtime_sec = st.st_mtim.tv_sec;
+	hdr.mtime_nsec = st.st_mtim.tv_nsec;
+	hdr.nobjs = nents;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (j = 0; j < nents; ++j) {
+		obj.start = ents[j].start;
+		obj.end = ents[j].end;
+		fwrite(&obj, sizeof(obj), 1, fp);
+	}
+	for (j = strs = 0; j < nents; ++j) {
+		uid.uid = strs;
+		strs += strlen(ents[j].uid)+1;
+		uid.type = strs;
+		strs += strlen(ents[j].type)+1;
+		uid.child = ents[j].child;
+		fwrite(&uid, sizeof(uid), 1, fp);
+	}
+	for (j = 0; j < nents; ++j) {
+		fwrite(ents[j].uid, strlen(ents[j].uid)+1, 1, fp);
+		fwrite(ents[j].type, strlen(ents[j].type)+1, 1, fp);
+	}
+	ret = vindex_commit(fp, tmpfile, indexfile);
+fail_tmp:
+	for (j = 0; j < nents; ++j) {
+		free(ents[j].uid);
+		free(ents[j].type);
+	}
+	if (ents)
+		free(ents);
+	vobject_munmap(dat, len);
+fail_stat:
+	close(fd);
+	return ret;
+}
+
+struct vobject_index *vobject_uidindex_open(const char *file,
+		const char *indexfile)
+{
+	struct vobject_index *idx;
+	size_t j, nstrs;
+
+	idx = vindex_open(file, indexfile, VUIDX_MAGIC);
+	if (!idx)
+		return NULL;
+	/* the string table ends with a 0 */
+	if (idx->hdr->nobjs > (idx->len - sizeof(struct vihdr)) /
+			(sizeof(struct viobj) + sizeof(struct viuid)) ||
+			idx->dat[idx->len-1])
+		goto fail;
+	idx->uids = (const void *)(idx->objs + idx->hdr->nobjs);
+	idx->strs = (const void *)(idx->uids + idx->hdr->nobjs);
+	/* so each string that starts inside it is terminated */
+	nstrs = idx->dat + idx->len - idx->strs;
+	for (j = 0; j < idx->hdr->nobjs; ++j) {
+		if (idx->uids[j].uid >= nstrs || idx->uids[j].type >= nstrs)
+			goto fail;
+	}
+	return idx;
+fail:
+	vobject_index_close(idx);
+	return NULL;
+}
+
+int vobject_uidindex_lookup(struct vobject_index *idx, const char *uid,
+		int *pobj)
+{
+	size_t lo = 0, hi = idx->hdr->nobjs, mid;
+	int n;
+
+	/* find the first */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(idx->strs + idx->uids[mid].uid, uid) < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	*pobj = lo;
+	for (n = 0; lo + n < idx->hdr->nobjs &&
+			!strcmp(idx->strs + idx->uids[lo+n].uid, uid); ++n);
+	return n;
+}
+
+const char *vobject_uidindex_type(struct vobject_index *idx, int obj)
+{
+	if (obj < 0 || obj >= idx->hdr->nobjs)
+		return NULL;
+	return idx->strs + idx->uids[obj].type;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2014 Kurt Van Dijck <kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _VOPRIV_H_
+#define _VOPRIV_H_
+
+/* private to the sources of the vobject library */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+/* generic error logging, exits for LOG_ERR and more severe levels */
+#define elog(level, errnum, fmt, ...) \
+	{\
+		fprintf(stderr, "%s: " fmt "\n", "vobject", ##__VA_ARGS__);\
+		if (errnum)\
+			fprintf(stderr, "\t: %s\n", strerror(errnum));\
+		if (level <= LOG_ERR)\
+			exit(1);\
+		fflush(stderr);\
+	}
+
+#endif
@@ -48,6 +48,8 @@ static const char help_msg[] =
 	" *cat		Read & write to stdout\n"
 	"  split	Split VCalendar's so each contains only 1 VEVENT\n"
 	"  subject	Return a subject for each vobject\n"
+	"  index	Index the vobjects of FILE by UID, in FILE.voidx\n"
+	"  get		Output vobjects by UID: " NAME " get FILE UID ...\n"
 	"\n"
 	"Options\n"
 	" -V, --version		Show version\n"
@@ -56,9 +58,11 @@ static const char help_msg[] =
 	"	* break		Break lines on 80 columns\n"
 	"	  utf8		Avoid breaking inside UTF8 sequences, break before\n"
 	"	  crnl		write with \\r\\n line endings\n"
+	"	  width=N	Break lines on N columns (16..255), 75 for the RFC\n"
 	"	  fix		Fix vobjects before processing\n"
 	"			- Enforce single N for VCard\n"
 	" -O, --output=FILE	Output all vobjects to FILE\n"
+	" -j, --jobs=N		Parse with N threads (cat)\n"
 
 	"\n"
 	"Arguments\n"
@@ -72,6 +76,7 @@ enum subopt {
 	OPT_CRNL,
 	OPT_FIX,
 	OPT_SORT,
+	OPT_WIDTH,
 };
 
 static char *const subopttable[] = {
@@ -80,6 +85,7 @@ static char *const subopttable[] = {
 	"crnl",
 	"fix",
 	"sort",
+	"width",
 	0,
 };
 
@@ -91,6 +97,7 @@ static struct option long_opts[] = {
 
 	{ "options", required_argument, NULL, 'o', },
 	{ "output", required_argument, NULL, 'O', },
+	{ "jobs", required_argument, NULL, 'j', },
 
 	{ },
 };
@@ -98,13 +105,16 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?o:O:";
+static const char optstring[] = "Vv?o:O:j:";
 
 /* program variables */
 static int verbose;
 static const char *action = "";
 static int flags;
 static char *outputfile;
+static int jobs;
+/* vobjects to stdout */
+static struct vobject_sink *out;
 
 /* generic file open method */
 static FILE *myfopen(const char *filename, const char *mode)
@@ -123,6 +133,30 @@ static FILE *myfopen(const char *filename, const char *mode)
 		return fopen(filename, mode);
 }
 
+static void flush_output(void)
+{
+	if (!out)
+		return;
+	if (vobject_sink_flush(out) < 0) {
+		elog(0, errno, "write");
+		_exit(1);
+	}
+	vobject_sink_free(out);
+	out = NULL;
+}
+
+/* write 1 vobject to the output */
+static void out_vobject(const struct vobject *vo)
+{
+	if (vobject_write_sink(vo, out, flags) >= 0)
+		return;
+	elog(0, errno, "write");
+	/* the output is lost, don't flush it at exit */
+	vobject_sink_free(out);
+	out = NULL;
+	exit(1);
+}
+
 static void redirect_output(void)
 {
 	if (outputfile && strcmp("-", outputfile)) {
@@ -135,24 +169,35 @@ static void redirect_output(void)
 			elog(1, errno, "dup2 %s", outputfile);
 		close(fd);
 	}
+	out = vobject_sink_fd(STDOUT_FILENO);
+	atexit(flush_output);
 }
 
+/* print between the vobjects of the sink */
+#define verbose_printf(fmt, ...) \
+	do { \
+		vobject_sink_flush(out); \
+		printf(fmt, ##__VA_ARGS__); \
+		fflush(stdout); \
+	} while (0)
+
 /* fix some vobject problems */
 static void vobject_fix(struct vobject *vo)
 {
-	if (!strcasecmp(vobject_type(vo), "VCALENDAR")) {
+	const char *propn, *next;
+	const char *Nvalue = NULL, *str;
+
+	switch (vobject_kind(vo)) {
+	case VK_VCALENDAR:
 		for (vo = vobject_first_child(vo); vo;
 				vo = vobject_next_child(vo))
 			vobject_fix(vo);
-		return;
-	} else if (!strcasecmp(vobject_type(vo), "VCARD")) {
-		const char *propn, *next;
-		const char *Nvalue = NULL, *str;
-
+		break;
+	case VK_VCARD:
 		for (propn = vobject_first_prop(vo); propn; propn = next) {
 			/* get next prop already */
 			next = vprop_next(propn);
-			if (!strcasecmp(propn, "N")) {
+			if (vprop_atom(propn) == VA_N) {
 				str = vprop_value(propn);
 				if (!Nvalue)
 					Nvalue = str;
@@ -164,6 +209,9 @@ static void vobject_fix(struct vobject *vo)
 				}
 			}
 		}
+		break;
+	default:
+		break;
 	}
 }
 
@@ -197,25 +245,29 @@ static void local_vobject_sort(struct vobject *vo)
 
 static const char *find_suffix(const struct vobject *vo)
 {
-	return !strcasecmp("vcard", vobject_type(vo)) ? "vcf" : "ics";
+	return (vobject_kind(vo) == VK_VCARD) ? "vcf" : "ics";
 }
 
 static const char *find_prefix(const struct vobject *vo)
 {
-	const char *type = vobject_type(vo), *saved_type;
+	const char *type, *saved_type;
 
-	if (!strcasecmp(type, "vcard"))
+	switch (vobject_kind(vo)) {
+	case VK_VCARD:
 		return "card";
-	if (!strcasecmp(type, "vevent"))
+	case VK_VEVENT:
 		return "evnt";
-	else if (!strcasecmp(type, "vtodo"))
+	case VK_VTODO:
 		return "todo";
-	else if (!strcasecmp(type, "vjournal"))
+	case VK_VJOURNAL:
 		return "jrnl";
-	else if (!strcasecmp(type, "vfreebusy"))
+	case VK_VFREEBUSY:
 		return "busy";
-	else if (strcasecmp(type, "vcalendar"))
+	case VK_VCALENDAR:
+		break;
+	default:
 		return NULL;
+	}
 	/* vcalendar */
 	saved_type = NULL;
 	for (vo = vobject_first_child(vo); vo; vo = vobject_next_child(vo)) {
@@ -232,126 +284,97 @@ static const char *find_prefix(const struct vobject *vo)
 static void myvobject_write(const struct vobject *vo)
 {
 	int fd;
-	FILE *fp;
+	struct vobject_sink *s;
 	char filename[32];
 
 	if (outputfile) {
 		/* output to single file, dup2'd to stdout */
-		vobject_write2(vo, stdout, flags);
+		out_vobject(vo);
 		return;
 	}
 	sprintf(filename, "%s-XXXXXX.%s", find_prefix(vo) ?: "cal", find_suffix(vo));
 	fd = mkstemps(filename, strlen(strrchr(filename, '.')));
 	if (fd < 0)
 		elog(1, errno, "mkstmp %s", filename);
-	fp = fdopen(fd, "w");
-	if (!fp)
-		elog(1, errno, "fdopen %s", filename);
-	vobject_write2(vo, fp, flags);
-	fclose(fp);
+	s = vobject_sink_fd(fd);
+	if (vobject_write_sink(vo, s, flags) < 0 || vobject_sink_flush(s) < 0)
+		elog(1, errno, "write %s", filename);
+	vobject_sink_free(s);
 	close(fd);
 }
 
 /*
  * SPLIT
  */
-static void copy_timezones(const struct vobject *dut, struct vobject *root,
-		const struct vobject *origroot)
-{
-	const char *prop, *tzstr;
-
-	const struct vobject *tz;
-
-	for (prop = vobject_first_prop(dut); prop; prop = vprop_next(prop)) {
-		tzstr = vprop_meta(prop, "tzid");
-		if (!tzstr)
-			continue;
-
-		/* look for VTIMEZONE @tzstr */
-		for (tz = vobject_first_child(root); tz; tz = vobject_next_child(tz)) {
-			if (strcasecmp("VTIMEZONE", vobject_type(tz)))
-				continue;
-			if (!strcmp(vobject_prop(tz, "tzid") ?: "", tzstr))
-				/* VTIMEZONE already present */
-				break;
-		}
-		if (tz)
-			continue;
-		/* find the timezone in original vobject */
-		for (tz = vobject_first_child(origroot); tz; tz = vobject_next_child(tz)) {
-			if (strcasecmp("VTIMEZONE", vobject_type(tz)))
-				continue;
-			if (!strcmp(vobject_prop(tz, "tzid") ?: "", tzstr)) {
-				/* append timezone */
-				vobject_attach(vobject_dup(tz), root);
-				break;
-			}
-		}
-		if (!tz)
-			elog(0, 0, "Timezone '%s' not found", tzstr);
-	}
-
-}
 /* real split program */
 void icalsplit(FILE *fp, const char *name)
 {
 	struct vobject *root, *sub;
-	struct vobject *newroot, *newsub;
-	int linenr = 0;
+	struct vobject *newroot;
+	struct vobject_reader *rd;
 
+	rd = vobject_reader_fd(fileno(fp), 0);
+	vobject_reader_lazy(rd, VOBJECT_LAZY_SIZE);
+	vobject_reader_raw(rd);
 	while (1) {
-		root = vobject_next(fp, &linenr);
+		root = vobject_reader_next(rd);
 		if (!root)
 			break;
 		if (flags & (1 << OPT_FIX))
 			vobject_fix(root);
 		if (flags & (1 << OPT_SORT))
 			local_vobject_sort(root);
-		if (strcasecmp(vobject_type(root), "VCALENDAR"))
+		if (vobject_kind(root) != VK_VCALENDAR)
 			/* save single non-calendar element */
 			myvobject_write(root);
 		else for (sub = vobject_first_child(root); sub; sub =
 				vobject_next_child(sub)) {
 			/* save (potentially) each single element */
-			if (!strcasecmp(vobject_type(sub), "VTIMEZONE"))
+			if (vobject_kind(sub) == VK_VTIMEZONE)
 				/* skip timezones */
 				continue;
-			newroot = vobject_dup_root(root);
-			newsub = vobject_dup(sub);
-			copy_timezones(newsub, newroot, root);
-			vobject_attach(newsub, newroot);
-			/* todo : timezones */
+			newroot = vobject_dup_split(root, sub);
 			myvobject_write(newroot);
 			vobject_free(newroot);
 		}
 		vobject_free(root);
 	}
+	vobject_reader_free(rd);
+}
+
+/* process & write 1 vobject */
+static void cat_vobject(struct vobject *vc, void *dat)
+{
+	if (flags & (1 << OPT_FIX))
+		vobject_fix(vc);
+	if (flags & (1 << OPT_SORT))
+		local_vobject_sort(vc);
+	out_vobject(vc);
+	vobject_free(vc);
 }
 
 /* retrieve short subject */
 const char *vosubject(const struct vobject *vo)
 {
-	const char *type = vobject_type(vo);
-
-	if (!strcasecmp("vcalendar", type)) {
-		const char *result;
+	const char *result;
 
+	switch (vobject_kind(vo)) {
+	case VK_VCALENDAR:
 		for (vo = vobject_first_child(vo); vo; vo = vobject_next_child(vo)) {
 			result = vosubject(vo);
 			if (result)
 				return result;
 		}
 		return "vcalendar without subject";
-	} else if (!strcasecmp(type, "vcard"))
-		return vobject_prop(vo, "FN") ?: "vcard without subject";
-	else if (!strcasecmp(type, "vevent"))
-		return vobject_prop(vo, "summary");
-	else if (!strcasecmp(type, "vtodo"))
-		return vobject_prop(vo, "summary");
-	else if (!strcasecmp(type, "vjournal"))
-		return vobject_prop(vo, "summary");
-	else
+	case VK_VCARD:
+		return vobject_prop_atom(vo, VA_FN) ?: "vcard without subject";
+	case VK_VEVENT:
+	case VK_VTODO:
+	case VK_VJOURNAL:
+		return vobject_prop_atom(vo, VA_SUMMARY);
+	default:
 		return NULL;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -395,6 +418,17 @@ int main(int argc, char *argv[])
 				break;
 			}
 			switch (opt) {
+			case OPT_WIDTH:
+				flags &= ~VOF_WIDTH_MASK;
+				if (!not && optarg) {
+					char *end;
+					unsigned long width = strtoul(optarg, &end, 0);
+
+					if (*end || width < 16 || width > 255)
+						elog(1, 0, "width '%s' not in 16..255", optarg);
+					flags |= VOF_WIDTH(width);
+				}
+				break;
 			case OPT_BREAK:
 				/* invert 'not' */
 				not = !not;
@@ -411,6 +445,9 @@ int main(int argc, char *argv[])
 	case 'O':
 		outputfile = optarg;
 		break;
+	case 'j':
+		jobs = strtoul(optarg, NULL, 0);
+		break;
 
 	case '?':
 		fputs(help_msg, stderr);
@@ -439,13 +476,15 @@ int main(int argc, char *argv[])
 			if (!fp)
 				elog(1, errno, "fopen %s", *argv);
 			if (verbose)
-				printf("## %s\n", *argv);
+				verbose_printf("## %s\n", *argv);
 			icalsplit(fp, basename(*argv));
 			fclose(fp);
 		}
 	} else if (!strcmp("cat", action)) {
-		struct vobject * vc;
-		int linenr = 0;
+		struct vobject *vc;
+		struct vobject_reader *rd;
+		char *dat;
+		size_t len;
 
 		if (!argv)
 			elog(1, 0, "no input files");
@@ -454,25 +493,74 @@ int main(int argc, char *argv[])
 			fp = myfopen(*argv, "r");
 			if (!fp)
 				elog(1, errno, "fopen %s", *argv);
-			linenr = 0;
 			if (verbose)
-				printf("## %s\n", *argv);
-			while (1) {
-				vc = vobject_next(fp, &linenr);
-				if (!vc)
-					break;
-				if (flags & (1 << OPT_FIX))
-					vobject_fix(vc);
-				if (flags & (1 << OPT_SORT))
-					local_vobject_sort(vc);
-				vobject_write2(vc, stdout, flags);
-				vobject_free(vc);
+				verbose_printf("## %s\n", *argv);
+			dat = (jobs > 1) ? vobject_mmap(fileno(fp), &len) : NULL;
+			if (dat) {
+				/* pass unmodified vobjects through */
+				vobject_parse_parallel(dat, dat+len, fileno(fp),
+						jobs, NULL, cat_vobject, NULL);
+				vobject_munmap(dat, len);
+			} else {
+				rd = vobject_reader_fd(fileno(fp), 0);
+				vobject_reader_lazy(rd, VOBJECT_LAZY_SIZE);
+				/* pass unmodified vobjects through */
+				vobject_reader_raw(rd);
+				while ((vc = vobject_reader_next(rd)) != NULL)
+					cat_vobject(vc, NULL);
+				vobject_reader_free(rd);
 			}
 			fclose(fp);
 		}
+	} else if (!strcmp("index", action)) {
+		char *indexfile;
+
+		if (!argv)
+			elog(1, 0, "no input files");
+		for (; *argv; ++argv) {
+			asprintf(&indexfile, "%s.voidx", *argv);
+			if (vobject_uidindex_build(*argv, indexfile) < 0)
+				elog(1, errno, "index %s", *argv);
+			if (verbose)
+				printf("## %s\n", indexfile);
+			free(indexfile);
+		}
+	} else if (!strcmp("get", action)) {
+		struct vobject_index *idx;
+		struct vobject *vc;
+		char *indexfile;
+		int obj, n, missing = 0;
+
+		if (!argv)
+			elog(1, 0, "no input file");
+		asprintf(&indexfile, "%s.voidx", *argv);
+		idx = vobject_uidindex_open(*argv, indexfile);
+		if (!idx)
+			elog(1, errno, "%s missing or outdated, run '%s index %s'",
+					indexfile, NAME, *argv);
+		free(indexfile);
+		redirect_output();
+		for (++argv; *argv; ++argv) {
+			n = vobject_uidindex_lookup(idx, *argv, &obj);
+			if (!n) {
+				elog(0, 0, "UID %s not found", *argv);
+				missing = 1;
+			}
+			for (; n; --n, ++obj) {
+				if (verbose)
+					verbose_printf("## %s %s\n", *argv,
+							vobject_uidindex_type(idx, obj));
+				vc = vobject_index_get(idx, obj);
+				if (!vc)
+					elog(1, 0, "UID %s unreadable", *argv);
+				cat_vobject(vc, NULL);
+			}
+		}
+		vobject_index_close(idx);
+		return missing;
 	} else if (!strcmp("subject", action)) {
 		struct vobject *vc;
-		int linenr;
+		struct vobject_reader *rd;
 
 		if (!argv)
 			elog(1, 0, "no input files");
@@ -482,14 +570,17 @@ int main(int argc, char *argv[])
 			fp = myfopen(*argv, "r");
 			if (!fp)
 				elog(1, errno, "fopen %s", *argv);
-			linenr = 0;
+			rd = vobject_reader_fd(fileno(fp), 0);
+			/* subjects never need PHOTO and alike */
+			vobject_reader_lazy(rd, VOBJECT_LAZY_SIZE);
 			while (1) {
-				vc = vobject_next(fp, &linenr);
+				vc = vobject_reader_next(rd);
 				if (!vc)
 					break;
 				printf("%s\t%s\n", *argv, vosubject(vc));
 				vobject_free(vc);
 			}
+			vobject_reader_free(rd);
 			fclose(fp);
 		}
 	} else {